@@ -1,30 +1,106 @@
 // 2020-11-04
 
+#define _GNU_SOURCE // For copy_file_range
 #define INCLUDING_SM
 
 #include "macros.h"
 #include "state_machine.c"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define GENERIC_BUF_SIZE 256
+#define SCAN_BUF_SIZE 65536
 #define FB_MAX_BUF_SIZE 20480 // 20 KiB
-#define LABEL_MAX_SIZE 64
+#define LABEL_MAX_SIZE SM_LABEL_MAX_SIZE
 
 #define LABELTRACK_SLOTS 64
 
+#define STATS_HASH_SEED 0x9e3779b97f4a7c15ULL // Starting value of section hashes
+#define STATS_HASH_MULT 0xff51afd7ed558ccdULL // Multiplier mixing in each word
+#define SWAR_ONES 0x0101010101010101ULL       // A 1 in every byte of a word
+
+#define MAX_FILTERS 16
+
+#define LINE_SAMPLE_INTERVAL 1024 // Newlines between line index samples
+#define RANGE_MAX_READ (1 << 20)   // Largest single read when printing ranges
+#define RANGE_MAX_VALUE (LONG_MAX / 2) // Largest range end accepted, so it can be
+                                       // added to a line number or offset
+
+#define PREVIEW_LINES 2          // Lines of each section shown in previews
+#define PREVIEW_BYTES 96         // Longest preview shown, less than 256
+#define PREVIEW_READ 512         // Bytes read from the start of each section
+#define PREVIEW_BATCH_SPAN 65536 // Furthest apart sections read together
+#define PREVIEW_BATCH_LABELS 256 // Most sections read together
+#define PREVIEW_RING 64          // Batches read ahead of the listing at most
+#define PREVIEW_MIN_THREADS 4    // Reads block, so use a few even on one CPU
+#define PREVIEW_MAX_THREADS 16
+
+#define SEARCH_GRAM_SIZE 3
+#define SEARCH_MAX_RESULTS 40
+
+#define LABEL_NONE UINT_MAX // No such label, for parent and subtree_end
+
+#define SPILL_PAGE_RECORDS 64 // Spilled labels read in at a time
+#define SPILL_PAGES 8         // Pages of spilled labels cached
+#define SPILL_MIN_CAP (1 << 20) // Smallest memory cap allowed
+
+#define OUT_BUF_SIZE (1 << 20)     // Bytes buffered before each bulk write
+#define OUT_MAX_RECORD 1024        // Upper bound on one formatted label record
+#define LABEL_RECORD_MAGIC "FILERLB1"
+
+#define EXPORT_NONE 0
+#define EXPORT_NDJSON 1
+#define EXPORT_TSV 2
+#define EXPORT_BINARY 3
+
 #define FB_INITIALIZED 0x01
 #define FB_LOADED_LABELS 0x04
+#define FB_SCANNER 0x08 // Background scanner thread started, needs joining
 
 const static char filespath[] = "./dfiles/";
 
 
+typedef struct {
+  long int           bytes; // Size of section, up to the next delimiter line
+  unsigned int       lines; // Number of newlines in section
+  unsigned int       words; // Number of whitespace separated words in section
+  unsigned long long hash;  // Hash of section contents, 8 bytes per step
+} section_stats;
+
+typedef struct {
+  section_stats cur;        // Running stats for the section being scanned; the
+                            // hash is unfinished, and lines are counted by the
+                            // caller
+  unsigned char tail[8];    // Bytes not yet mixed into the hash
+  unsigned int  tail_len;   // Number of bytes in tail
+  char          in_word;    // Whether the last byte scanned was part of a word
+} section_accum;
+
+typedef struct {
+  long int       fpos; // Offset of the start of a line
+  unsigned long  line; // Number of that line, counting from 0
+} line_sample;
+
 typedef struct labeltracknode_s {
   struct labeltracknode_s * next;
+  int                       used; // Number of slots holding labels
   unsigned int              lengths[LABELTRACK_SLOTS];
   long int                  positions[LABELTRACK_SLOTS];
+  unsigned char             levels[LABELTRACK_SLOTS];
+  unsigned char             dropped[LABELTRACK_SLOTS]; // Set for labels the
+                            // filters dropped, kept only to close subtrees
+  section_stats             stats[LABELTRACK_SLOTS];
   char                      label_texts[LABELTRACK_SLOTS * LABEL_MAX_SIZE];
 } labeltracknode;
 
@@ -32,8 +108,55 @@ typedef struct {
   char         * text;   // Pointer into fb.label_texts for text of label
   long int       fpos;   // Position of label in file
   unsigned int   length; // Length of label text
+  section_stats  stats;  // Statistics of the section starting at this label
+  unsigned int   level;  // Nesting level of the delimiter, 0 for outermost
+  unsigned int   parent; // Index of the enclosing label, or LABEL_NONE
+  unsigned int   subtree_end; // One past the last label nested in this one,
+                              // or LABEL_NONE while that is not known yet
 } label;
 
+/* Binary export layout: one header, then label_count fixed-width records in
+ * host byte order, so the output can be mapped and indexed directly.
+ */
+typedef struct {
+  char           magic[8];    // LABEL_RECORD_MAGIC, not NUL terminated
+  uint32_t       record_size; // sizeof(label_record)
+  uint32_t       count;       // Number of records following
+} label_record_header;
+
+typedef struct {
+  uint64_t       fpos;        // Position of label in file
+  uint64_t       bytes;       // Size of the label's section
+  uint32_t       index;       // Index of the label
+  uint32_t       parent;      // Index of the enclosing label, or LABEL_NONE
+  uint8_t        level;       // Nesting level of the delimiter
+  uint8_t        length;      // Length of label text
+  char           text[LABEL_MAX_SIZE]; // Label text, zero padded
+  uint8_t        pad[6];
+} label_record;
+
+/* A label spilled to disk under a memory cap, with its text inline. The text
+ * pointer is meaningless on disk, and is pointed at text when read back.
+ */
+typedef struct {
+  label          lab;
+  char           text[LABEL_MAX_SIZE];
+} spill_record;
+
+typedef struct {
+  unsigned int   first;       // Index of the first label held, or LABEL_NONE
+  unsigned int   count;       // Number of labels held
+  unsigned long  used;        // Value of spill_clock when last used
+  spill_record   records[SPILL_PAGE_RECORDS];
+} spill_page;
+
+typedef struct {
+  char         * buf;         // OUT_BUF_SIZE bytes of pending output
+  size_t         used;        // Bytes of buf holding output
+  int            fd;          // Descriptor to write to
+  char           failed;      // Set once a write has failed
+} outbuf;
+
 typedef struct {
   const char   * fname;       // File name
   FILE         * fhandle;     // Handle for open file
@@ -44,6 +167,35 @@ typedef struct {
   char           operations;  // Indicator for actions performed
   char           no_use_buf;  // Boolean to prevent loading buf, if desired
   char         * buf;         // Buffer for file contents if within set limit
+  unsigned int * label_order; // Label indices sorted by label text
+  unsigned long long * label_grams; // Sorted (trigram << 32 | label index) keys
+  size_t         gram_count;  // Number of entries in label_grams
+  unsigned int   label_capacity; // Number of label structs allocated
+  size_t         texts_used;  // Bytes of label_texts holding label text
+  size_t         texts_capacity; // Bytes of label_texts allocated
+  unsigned int   open_sections[SM_MAX_LEVELS]; // Labels whose subtrees are
+  unsigned int   open_depth;  // still open while scanning, outermost first
+  line_sample  * line_samples; // Start of every LINE_SAMPLE_INTERVAL'th line
+  size_t         line_sample_count; // Number of entries in line_samples
+  size_t         line_sample_capacity; // Number of entries allocated
+  const sm_table * table;     // Compiled delimiter grammar to scan with
+  char           lazy;        // Boolean to index labels in the background
+  regex_t      * filters;     // If set, only labels matching one are kept
+  unsigned int   filter_count; // Number of compiled regexes in filters
+  char           scanning;    // Set while the background scan is finding labels
+  char           stop_scan;   // Set to ask the background scan to give up
+  pthread_t      scanner;     // Thread running the background scan
+  pthread_mutex_t lock;       // Guards label data while the scanner runs
+  pthread_cond_t found;       // Signalled when the scanner adds labels
+  size_t         mem_cap;     // If set, most bytes of label table held in memory
+  unsigned int   mem_labels;  // Labels held in memory under mem_cap
+  FILE         * spill;       // Temporary file of labels moved out of memory
+  unsigned int   spill_count; // Labels [0, spill_count) are in the spill file,
+                              // the rest in labels from index 0
+  spill_page   * spill_pages; // Cache of pages read back from the spill file
+  unsigned long  spill_clock; // Counter for least recently used page eviction
+  unsigned long long spill_bytes; // Bytes written to the spill file
+  unsigned long  spill_reads; // Pages read back from the spill file
 } fileblock;
 
 
@@ -51,15 +203,50 @@ int init_fileblock(fileblock *);
 int close_fileblock(fileblock *);
 int load_fileblock_file_maybe(fileblock *);
 int load_fileblock_labels(fileblock *);
+int start_fileblock_scan(fileblock *);
 
 void list_fileblock_labels(fileblock *);
+void list_fileblock_previews(fileblock *);
 void show_fileblock_section(fileblock *, unsigned int);
+void show_fileblock_subtree(fileblock *, unsigned int);
+void list_fileblock_children(fileblock *, unsigned int);
+void find_fileblock_offset(fileblock *, long int);
+void show_fileblock_lines(fileblock *, unsigned int, long int, long int);
+void show_fileblock_bytes(fileblock *, unsigned int, long int, long int);
+
+int build_label_search(fileblock *);
+void search_fileblock_labels(fileblock *, const char *, unsigned int);
+
+int diff_fileblocks(fileblock *, fileblock *, char);
+
+int export_fileblock_labels(fileblock *, int, int);
+
+int replace_fileblock_section(fileblock *, unsigned int, const char *);
+int insert_fileblock_section(fileblock *, unsigned int, const char *, const char *);
+int delete_fileblock_section(fileblock *, unsigned int);
 
 long int get_file_size(FILE *);
 int dump_file_contents(FILE *);
 void test_dump_fileblock(fileblock *);
 
 int get_user_number(int, int, int *);
+int get_user_string(char *, int);
+
+static void lock_labels(fileblock *);
+static label * get_label(fileblock *, unsigned int);
+static int write_all(int, const char *, size_t);
+static void unlock_labels(fileblock *);
+static unsigned int wait_for_labels(fileblock *, unsigned int);
+static long int line_of_offset(fileblock *, long int);
+static long int subtree_end_pos(fileblock *, unsigned int);
+static int wait_for_scan(fileblock *);
+static int label_passes_filters(fileblock *, const char *, unsigned int);
+static int compare_label_text(const label *, const label *);
+static unsigned long long gram_key(const char *);
+static void search_labels_locked(fileblock *, const char *, unsigned int);
+static int select_label(fileblock *);
+static int print_file_range(fileblock *, long int, long int);
+static int get_user_range(long int *, long int *);
 
 
 /* The main event.
@@ -68,9 +255,105 @@ int main(int argl, char ** argv){
 
   const char * fname;
   int rval;
+  int opt;
+  char lazy = 0;
+  char diff = 0;
+  char diff_contents = 0;
+  int export = EXPORT_NONE;
+  size_t mem_cap = 0;
+  regex_t filters[MAX_FILTERS];
+  unsigned int filter_count = 0;
+  sm_grammar grammar;
+  static sm_table table;
+  unsigned int delim_count = 0;
+
+  sm_grammar_default(&grammar);
+
+  while((opt = getopt(argl, argv, "lf:d:n:sc:Dpo:m:")) != -1){
+    switch(opt){
+    case 'l': lazy = 1; break;
+    case 'D': diff = 1; break;
+    case 'p': diff_contents = 1; break;
+    case 'd':
+      // The first delimiter replaces the default, later ones nest inside it
+      if(strlen(optarg) != 1){
+        fprintf(stderr, "Delimiter must be a single character\n");
+        return 1;
+      }
+      if(delim_count == SM_MAX_LEVELS){
+        fprintf(stderr, "Too many delimiter levels (max %d)\n", SM_MAX_LEVELS);
+        return 1;
+      }
+      grammar.delims[delim_count++] = optarg[0];
+      grammar.levels = delim_count;
+      break;
+    case 'n':
+      if(sscanf(optarg, "%u", &grammar.min_run) != 1){
+        fprintf(stderr, "Invalid delimiter run length \"%s\"\n", optarg);
+        return 1;
+      }
+      break;
+    case 's': grammar.same_line = 1; break;
+    case 'm':
+      {
+        char unit = '\0';
+        unsigned long long amount;
+        int n = sscanf(optarg, "%llu%c", &amount, &unit);
+        if(n == 2 && (unit == 'k' || unit == 'K')) amount <<= 10;
+        else if(n == 2 && (unit == 'm' || unit == 'M')) amount <<= 20;
+        else if(n == 2 && (unit == 'g' || unit == 'G')) amount <<= 30;
+        else if(n != 1) amount = 0;
+
+        if(amount < SPILL_MIN_CAP){
+          fprintf(stderr, "Invalid memory cap \"%s\" (at least %d bytes, K, M or G suffix)\n", optarg, SPILL_MIN_CAP);
+          return 1;
+        }
+        mem_cap = (size_t)amount;
+      }
+      break;
+    case 'o':
+      if(strcmp(optarg, "ndjson") == 0) export = EXPORT_NDJSON;
+      else if(strcmp(optarg, "tsv") == 0) export = EXPORT_TSV;
+      else if(strcmp(optarg, "bin") == 0) export = EXPORT_BINARY;
+      else {
+        fprintf(stderr, "Invalid output format \"%s\" (ndjson, tsv or bin)\n", optarg);
+        return 1;
+      }
+      break;
+    case 'c':
+      if(sm_grammar_set_class(&grammar, optarg)){
+        fprintf(stderr, "Invalid label character class \"%s\"\n", optarg);
+        return 1;
+      }
+      break;
+    case 'f':
+      if(filter_count == MAX_FILTERS){
+        fprintf(stderr, "Too many label filters (max %d)\n", MAX_FILTERS);
+        return 1;
+      }
+      if(rval = regcomp(&filters[filter_count], optarg, REG_EXTENDED | REG_NOSUB)){
+        char errbuf[GENERIC_BUF_SIZE];
+        regerror(rval, &filters[filter_count], errbuf, sizeof(errbuf));
+        fprintf(stderr, "Invalid label filter \"%s\": %s\n", optarg, errbuf);
+        return 1;
+      }
+      ++filter_count;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-l | -m cap] [-f regex]... [-d delim] [-n run] [-s] [-c class] <filename>\n", argv[0]);
+      fprintf(stderr, "       %s -o ndjson|tsv|bin [options] <filename>\n", argv[0]);
+      fprintf(stderr, "       %s -D [-p] [options] <old filename> <new filename>\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if(sm_table_build(&table, &grammar)){
+    fprintf(stderr, "Invalid delimiter grammar (run length 1 - %d, distinct delimiters other than newline)\n", SM_MAX_RUN);
+    return 1;
+  }
 
-  if(argl > 1){
-    fname = argv[1];
+  if(optind < argl){
+    fname = argv[optind];
   } else {
     fname = filespath;
   }
@@ -78,14 +361,64 @@ int main(int argl, char ** argv){
   fileblock fblock = {
     .fname = fname,
     //.no_use_buf = 1,
+    .table = &table,
+    .lazy = lazy,
+    .filters = filter_count ? filters : NULL,
+    .filter_count = filter_count,
+    .mem_cap = mem_cap,
+    .mem_labels = mem_cap ? (unsigned int)((mem_cap - SPILL_PAGES * sizeof(spill_page)) / (sizeof(label) + LABEL_MAX_SIZE)) : 0,
   };
   fileblock * fb = &fblock;
 
+  if(mem_cap && (lazy || diff)){
+    fprintf(stderr, "A memory cap cannot be combined with lazy or diff mode\n");
+    return 1;
+  }
+
+  if(diff && export != EXPORT_NONE){
+    fprintf(stderr, "Diff mode and output formats cannot be combined\n");
+    return 1;
+  }
+
+  if(diff){
+    if(optind + 2 != argl){
+      fprintf(stderr, "Diff mode needs exactly two files\n");
+      return 1;
+    }
+
+    // Both files are indexed up front, so lazy mode does not apply
+    fileblock newblock = fblock;
+    newblock.fname = argv[optind + 1];
+    fblock.lazy = newblock.lazy = 0;
+
+    rval = diff_fileblocks(fb, &newblock, diff_contents);
+
+    close_fileblock(fb);
+    close_fileblock(&newblock);
+    for(unsigned int j = 0; j < filter_count; ++j)
+      regfree(&filters[j]);
+
+    return rval ? 2 : 0;
+  }
+
+  // Exporting needs the whole label table, so lazy mode does not apply
+  if(export != EXPORT_NONE) fb->lazy = 0;
+
   if(rval = init_fileblock(fb)){
     fprintf(stderr, "Error initializing file (%d)\n", rval);
     return 2;
   }
 
+  if(export != EXPORT_NONE){
+    rval = export_fileblock_labels(fb, export, STDOUT_FILENO);
+
+    close_fileblock(fb);
+    for(unsigned int j = 0; j < filter_count; ++j)
+      regfree(&filters[j]);
+
+    return rval ? 2 : 0;
+  }
+
   int input;
   char running = 1;
 
@@ -99,8 +432,18 @@ Which action to take?\n\
   1: Test dump\n\
   2: List labels\n\
   3: View label contents\n\
+  4: Search labels\n\
+  5: View label contents with nested sections\n\
+  6: List sections nested in label\n\
+  7: Find section and line containing file offset\n\
+  8: View lines of label contents\n\
+  9: View byte range of label contents\n\
+ 10: Replace label contents from file\n\
+ 11: Insert section after label from file\n\
+ 12: Delete label with nested sections\n\
+ 13: List labels with previews\n\
 ");
-    input = get_user_number(0, 3, NULL);
+    input = get_user_number(0, 13, NULL);
     if(input < 0){
       fprintf(stderr, "Input error\n");
       return 2;
@@ -108,30 +451,139 @@ Which action to take?\n\
 
     printf("\n");
 
+    // These need the whole label table in memory
+    if(fb->mem_cap && input >= 10){
+      printf("Not available with a memory cap\n");
+      continue;
+    }
+
     switch(input){
     case 0: running = 0; break;
     case 1: test_dump_fileblock(fb); break;
     case 2: list_fileblock_labels(fb); break;
+    case 13: list_fileblock_previews(fb); break;
     case 3:
-      if(fb->label_count < 1){
-        printf("No labels found, sorry\n");
-        break;
+    case 5:
+    case 6:
+      {
+        int lab = select_label(fb);
+        if(lab == -1) break;
+        if(lab < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        }
+
+        if(input == 3) show_fileblock_section(fb, (unsigned int)lab);
+        else if(input == 5) show_fileblock_subtree(fb, (unsigned int)lab);
+        else list_fileblock_children(fb, (unsigned int)lab);
+      }
+      break;
+    case 4:
+      {
+        char query[LABEL_MAX_SIZE + 1];
+
+        printf("Search for label text (prefix or substring): ");
+        int qlen = get_user_string(query, sizeof(query));
+        if(qlen < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        }
+
+        search_fileblock_labels(fb, query, (unsigned int)qlen);
+      }
+      break;
+    case 7:
+      {
+        char obuf[32];
+        long int offset;
+
+        printf("Enter a file offset (0 - %ld): ", fb->fsize - 1);
+        if(get_user_string(obuf, sizeof(obuf)) < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        }
+
+        if(sscanf(obuf, "%ld", &offset) != 1 || offset < 0 || offset >= fb->fsize){
+          printf("Invalid offset\n");
+          break;
+        }
+
+        find_fileblock_offset(fb, offset);
       }
+      break;
+    case 8:
+    case 9:
+      {
+        int lab = select_label(fb);
+        if(lab == -1) break;
+        if(lab < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        }
 
-      printf("Select label. ");
+        long int first, last;
 
-      input = get_user_number(0, fb->label_count - 1, NULL);
-      if(input < 0){
-        fprintf(stderr, "Input error\n");
-        return 2;
+        if(input == 8) printf("Enter lines of the section to view, from 1 (first-last): ");
+        else printf("Enter bytes of the section to view, from 0 (first-last): ");
+
+        rval = get_user_range(&first, &last);
+        if(rval < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        } else if(rval > 0){
+          printf("Invalid range\n");
+          break;
+        }
+
+        if(input == 8) show_fileblock_lines(fb, (unsigned int)lab, first, last);
+        else show_fileblock_bytes(fb, (unsigned int)lab, first, last);
       }
+      break;
+    case 10:
+    case 11:
+    case 12:
+      {
+        int lab = select_label(fb);
+        if(lab == -1) break;
+        if(lab < 0){
+          fprintf(stderr, "Input error\n");
+          return 2;
+        }
+
+        char text[LABEL_MAX_SIZE + 2];
+        char path[GENERIC_BUF_SIZE];
+
+        if(input == 11){
+          printf("Enter label of new section: ");
+          if(get_user_string(text, sizeof(text)) < 0){
+            fprintf(stderr, "Input error\n");
+            return 2;
+          }
+        }
 
-      show_fileblock_section(fb, (unsigned int)input);
+        if(input != 12){
+          printf("Enter file holding new contents (blank for none): ");
+          if(get_user_string(path, sizeof(path)) < 0){
+            fprintf(stderr, "Input error\n");
+            return 2;
+          }
+        }
+
+        if(input == 10) rval = replace_fileblock_section(fb, (unsigned int)lab, path);
+        else if(input == 11) rval = insert_fileblock_section(fb, (unsigned int)lab, text, path);
+        else rval = delete_fileblock_section(fb, (unsigned int)lab);
+
+        if(rval == 0) printf("File updated\n");
+      }
       break;
     }
   }
 
   close_fileblock(fb);
+
+  for(unsigned int j = 0; j < filter_count; ++j)
+    regfree(&filters[j]);
+
   return 0;
 }
 
@@ -157,6 +609,7 @@ int init_fileblock(fileblock * fb){
   // fb->label_count
   // fb->operations
   // fb->buf
+  // fb->scanning
 
   // Load new data into fileblock
 
@@ -164,7 +617,7 @@ int init_fileblock(fileblock * fb){
   if(fb->fhandle == NULL) return 3;
 
   fb->fsize = get_file_size(fb->fhandle);
-  if(!fb->fsize){
+  if(fb->fsize <= 0){
     fprintf(stderr, "Error in getting file size\n");
     return 3;
   }
@@ -174,6 +627,14 @@ int init_fileblock(fileblock * fb){
 
   int rval;
 
+  // In lazy mode, labels are found by a background scan while the file is
+  // already in use, so there is nothing more to do up front
+  if(fb->lazy){
+    if(rval = start_fileblock_scan(fb))
+      fprintf(stderr, "Error occured starting label scan (%d)\n", rval);
+    return 0;
+  }
+
   if(rval = load_fileblock_file_maybe(fb))
     fprintf(stderr, "Error occured loading fileblock (%d)\n", rval);
 
@@ -191,6 +652,21 @@ int init_fileblock(fileblock * fb){
 int close_fileblock(fileblock * fb){
   if(fb == NULL) return 1;
 
+  // Stop a background scan before pulling its file and labels away
+  if(fb->operations & FB_SCANNER){
+    pthread_mutex_lock(&fb->lock);
+    fb->stop_scan = 1;
+    pthread_mutex_unlock(&fb->lock);
+
+    pthread_join(fb->scanner, NULL);
+    pthread_cond_destroy(&fb->found);
+    pthread_mutex_destroy(&fb->lock);
+
+    fb->operations &= ~(FB_SCANNER);
+    fb->scanning = 0;
+    fb->stop_scan = 0;
+  }
+
   if(fb->fhandle != NULL){
     DEBUGPRINT("Cleaning up opened file")
     if(fclose(fb->fhandle) != 0){
@@ -211,6 +687,29 @@ int close_fileblock(fileblock * fb){
     DEBUGPRINT("No label text pointer to clean up")
   }
   fb->label_texts = NULL;
+  fb->label_capacity = 0;
+  fb->texts_used = 0;
+  fb->texts_capacity = 0;
+  fb->open_depth = 0;
+
+  free(fb->line_samples);
+  fb->line_samples = NULL;
+  fb->line_sample_count = 0;
+  fb->line_sample_capacity = 0;
+
+  if(fb->spill != NULL) fclose(fb->spill);
+  fb->spill = NULL;
+  free(fb->spill_pages);
+  fb->spill_pages = NULL;
+  fb->spill_count = 0;
+  fb->spill_bytes = 0;
+  fb->spill_reads = 0;
+
+  free(fb->label_order);
+  fb->label_order = NULL;
+  free(fb->label_grams);
+  fb->label_grams = NULL;
+  fb->gram_count = 0;
 
   // Labels cleared, so clear action flag
   fb->operations &= ~(FB_LOADED_LABELS);
@@ -287,328 +786,3049 @@ int load_fileblock_file_maybe(fileblock * fb){
 }
 
 
-/* Reads the labels from the given fileblock's file and adds label information
- * into to the labeltrack list, adding on new nodes as needed. This function
- * does not perform any cleanup of labeltrack nodes, even on error.
- *
- * This function uses the buf in the fileblock if available.
- *
- * Returns the number of labels found on success, or a negative number on error.
+/* Reset the given accumulator for the start of a new section.
  */
-int fill_labeltrackers(fileblock * fb, labeltracknode * root){
-  if(fb == NULL) return -1;
-  if(root == NULL) return -1;
-  if(!(fb->operations & FB_INITIALIZED)) return -2;
-  // This function doesn't care if labels were already loaded,
-  // as it does not modify the fileblock
+static void reset_section_accum(section_accum * acc){
+  acc->cur.bytes = 0;
+  acc->cur.lines = 0;
+  acc->cur.words = 0;
+  acc->cur.hash = STATS_HASH_SEED;
+  acc->tail_len = 0;
+  acc->in_word = 0;
+}
 
-  FILE * f = fb->fhandle;
-  char * buf;
-  char using_fb_buf;
-  long int bufsize = 0;
-  unsigned int lcount = 0;
-  sm_func smf = NULL;
 
-  // Use fb buf if available, otherwise allocate buffer
-  if(fb->buf == NULL){
-    using_fb_buf = 0;
-    bufsize = 4096;
-    buf = malloc(bufsize * sizeof(char));
-  } else {
-    using_fb_buf = 1;
-    bufsize = fb->fsize;
-    buf = fb->buf;
-  }
+/* Load 8 bytes as a little-endian word, so that hashes and word masks are the
+ * same on any host.
+ */
+static unsigned long long load_word(const void * p){
+  unsigned long long w;
+  memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
+}
 
-  if(buf == NULL){
-    fprintf(stderr, "Error allocating buffer to load labels\n");
-    return -3;
-  }
 
-  int lt_slot = 0;
-  int lt_text_pos = 0;
-  int lt_blocks = 1;
-  labeltracknode * lt_current = root;
+/* Mix one word into a section hash.
+ */
+static unsigned long long mix_word(unsigned long long hash, unsigned long long w){
+  return (((hash << 23) | (hash >> 41)) ^ w) * STATS_HASH_MULT;
+}
 
-  memset(lt_current->label_texts, '\0', sizeof(lt_current->label_texts));
 
-  // Outer loop is for reading chunks of file
-  // Inner loop is for moving through read buffer
-  if(!using_fb_buf) rewind(f);
-  while(1){
-    size_t read;
+/* Returns a word with the high bit set in each byte of w that is whitespace,
+ * as in isspace: ' ' or '\t' to '\r'.
+ */
+static unsigned long long space_bytes(unsigned long long w){
+  const unsigned long long high = 0x80 * SWAR_ONES;
+  const unsigned long long low = 0x7f * SWAR_ONES;
+  unsigned long long lo = w & low;
 
-    // Fill buffer as needed, set size of data
-    if(!using_fb_buf){
-      if(feof(f)) break;
-      read = fread(buf, sizeof(char), bufsize, f);
-      if(ferror(f)){
-        perror("Error reading file to get label count");
-        return -4;
-      }
-    } else {
-      read = fb->fsize;
-    }
+  // Each sum stays within its byte, as lo is at most 0x7f
+  unsigned long long blank = ~((lo ^ (0x20 * SWAR_ONES)) + low);
+  unsigned long long from_tab = lo + (0x80 - '\t') * SWAR_ONES;
+  unsigned long long past_cr = lo + (0x80 - '\r' - 1) * SWAR_ONES;
 
-    // Run state machine on the current chunk of data
-    for(long int pos = 0; pos < read; ++pos){
-      char * lstore = (lt_text_pos < LABEL_MAX_SIZE)
-        ? lt_current->label_texts + (LABEL_MAX_SIZE * lt_slot) + lt_text_pos
-        : NULL
-      ;
+  return (blank | (from_tab & ~past_cr)) & ~w & high;
+}
 
-      int rval = run_iteration(&smf, buf[pos], lstore);
 
-      if(rval == 0){
-        // Finished with a label:
-        // Put null char in text if room, store label length,
-        // advance and reset counters/trackers, allocate new node if needed
+/* Add a single byte to the word count.
+ */
+static unsigned int count_word_byte(unsigned char c, char * in_word){
+  char space = (c == ' ' || (c >= '\t' && c <= '\r'));
+  unsigned int start = !space && !*in_word;
+  *in_word = !space;
+  return start;
+}
 
-        unsigned int lt_text_len = LABEL_MAX_SIZE;
 
-        if(lt_text_pos < LABEL_MAX_SIZE){
-          lt_current->label_texts[LABEL_MAX_SIZE * lt_slot + lt_text_pos] = '\0';
-          lt_text_len = (unsigned int)strlen(lt_current->label_texts + LABEL_MAX_SIZE * lt_slot);
-        }
-        lt_text_pos = 0;
+/* Add the given bytes to the running section statistics: the byte and word
+ * counts, and the hash. Newlines are left to the caller, which can count
+ * them with memchr.
+ *
+ * The hash and the word count both step through the bytes a word at a time.
+ * Bytes short of a whole word are kept in the accumulator until more arrive,
+ * so the hash does not depend on how the section was split into reads.
+ */
+static void accumulate_section_stats(section_accum * acc, const char * buf, size_t len){
+  unsigned long long hash = acc->cur.hash;
+  unsigned int words = acc->cur.words;
+  char in_word = acc->in_word;
+  size_t j = 0;
+
+  // Top up the bytes left over from last time first
+  if(acc->tail_len > 0){
+    while(acc->tail_len < 8 && j < len){
+      words += count_word_byte((unsigned char)buf[j], &in_word);
+      acc->tail[acc->tail_len++] = (unsigned char)buf[j++];
+    }
+    if(acc->tail_len == 8){
+      hash = mix_word(hash, load_word(acc->tail));
+      acc->tail_len = 0;
+    }
+  }
 
-        lt_current->lengths[lt_slot] = lt_text_len;
+  const unsigned long long high = 0x80 * SWAR_ONES;
+  unsigned long long prev = in_word ? 0x80 : 0;
 
-        DEBUGPRINT_V("Finished label")
+  for(; j + 8 <= len; j += 8){
+    unsigned long long w = load_word(buf + j);
+    unsigned long long solid = ~space_bytes(w) & high;
 
-        // Increment slot and allocate a new node if all slots used up
-        if(++lt_slot % LABELTRACK_SLOTS == 0){
-          lt_current->next = (labeltracknode *)malloc(sizeof(labeltracknode));
-          lt_current = lt_current->next;
-          lt_slot = 0;
-          ++lt_blocks;
+    // A word starts at each non-space byte after a space byte
+    unsigned long long starts = solid & ~((solid << 8) | prev);
+    words += (unsigned int)(((starts >> 7) * SWAR_ONES) >> 56);
+    prev = solid >> 56;
 
-          memset(lt_current->label_texts, '\0', sizeof(lt_current->label_texts));
-        }
-      } else if(rval == 2){
-        // Track transition into label
-        long int cl_pos;
-        if(using_fb_buf) cl_pos = pos;
-        else cl_pos = (ftell(f) - read) + pos;
-        cl_pos += 1; // Shift forward to start of label
-
-        DEBUGPRINTD_V("Label transition at", (int)cl_pos)
-
-        lt_current->positions[lt_slot] = cl_pos;
-        ++lcount;
-      } else if(rval == 3){
-        // Advance text store pointer if something was stored
-        ++lt_text_pos;
-      }
-    }
+    hash = mix_word(hash, w);
+  }
+  in_word = prev != 0;
 
-    // If using fb buf, all of file done in one go
-    if(using_fb_buf) break;
+  for(; j < len; ++j){
+    words += count_word_byte((unsigned char)buf[j], &in_word);
+    acc->tail[acc->tail_len++] = (unsigned char)buf[j];
   }
 
-  DEBUGPRINTD("Found labels", lcount)
-  DEBUGPRINTD("Used labeltrack blocks", lt_blocks)
+  acc->cur.bytes += (long int)len;
+  acc->cur.words = words;
+  acc->cur.hash = hash;
+  acc->in_word = in_word;
+}
 
-  // Free buffer if we allocated our own
-  if(!using_fb_buf) free(buf);
 
-  return lcount;
+/* Returns the stats of everything accumulated so far, with the hash finished
+ * off by mixing in the leftover bytes and the length.
+ */
+static section_stats section_accum_stats(const section_accum * acc){
+  section_stats stats = acc->cur;
+  unsigned char last[8] = {0};
+  unsigned long long h = stats.hash;
+
+  memcpy(last, acc->tail, acc->tail_len);
+  h = mix_word(h, load_word(last)) ^ (unsigned long long)stats.bytes;
+
+  // Spread every bit over the whole hash
+  h ^= h >> 33;
+  h *= STATS_HASH_MULT;
+  h ^= h >> 33;
+  stats.hash = h;
+
+  return stats;
 }
 
 
-/* Follows the labeltrack chain from the given root, cleaning up everything as
- * it goes.
+/* Returns the number of newlines in the given bytes.
  */
-void free_labeltrack_chain(labeltracknode * lt_current){
-  while(lt_current != NULL){
-    labeltracknode * lt_next = lt_current->next;
-    free(lt_current);
-    lt_current = lt_next;
+static unsigned int count_newlines(const char * buf, size_t len){
+  const char * end = buf + len;
+  unsigned int lines = 0;
+
+  while((buf = memchr(buf, '\n', (size_t)(end - buf))) != NULL){
+    ++buf;
+    ++lines;
   }
+
+  return lines;
 }
 
 
-/* Reads the labels from the configured file in the provided initialized
- * fileblock and stores them properly into said fileblock.
- *
- * This function uses the buf in the fileblock if available.
+/* Take the lock guarding the fileblock's labels, if a background scan may be
+ * adding to them. Without lazy mode this does nothing.
  */
-int load_fileblock_labels(fileblock * fb){
-  if(fb == NULL) return 1;
-  if(!(fb->operations & FB_INITIALIZED)) return 2;
-  if(fb->operations & FB_LOADED_LABELS) return 3;
+static void lock_labels(fileblock * fb){
+  if(fb->operations & FB_SCANNER) pthread_mutex_lock(&fb->lock);
+}
 
-  labeltracknode root = {0};
-  labeltracknode * lt_current;
+static void unlock_labels(fileblock * fb){
+  if(fb->operations & FB_SCANNER) pthread_mutex_unlock(&fb->lock);
+}
 
-  // Step 1: Get info about labels
 
-  int lcount = fill_labeltrackers(fb, &root);
-  DEBUGPRINTD_V("Got labels", lcount)
-  if(lcount < 0){
-    fprintf(stderr, "Error occured in getting label info\n");
-    return 4;
-  } else if(lcount == 0) {
-    DEBUGPRINT("No labels found")
-    // Not an error condition, nothing further to do. Not necessary to
-    // free labeltrack chain, because nothing should have been allocated.
-    return 0;
+/* Wait, with the label lock held, until at least `n` labels are available or
+ * the background scan has finished.
+ *
+ * A label is only made available once the label following it has been found
+ * (or the file has ended), so its section is complete.
+ *
+ * Returns the number of labels available.
+ */
+static unsigned int wait_for_labels(fileblock * fb, unsigned int n){
+  if(fb->operations & FB_SCANNER){
+    while(fb->scanning && fb->label_count < n)
+      pthread_cond_wait(&fb->found, &fb->lock);
   }
 
-  /*
-  // Step 1.5: Check what we gots
-
-  // TEST PRINT::
-  lt_current = &root;
-  int bc = 1;
-  while(lt_current != NULL){
-    for(int p = 0; p < LABELTRACK_SLOTS; ++p)
-      fprintf(stderr,
-        "Block %2d,%3d (%u) : %ld - %s\n",
-        bc, p,
-        lt_current->lengths[p],
-        lt_current->positions[p],
-        &lt_current->label_texts[p * LABEL_MAX_SIZE]
-      );
-    ++bc;
-    lt_current = lt_current->next;
-  }
-  // ::TEST PRINT
-  */
+  return fb->label_count;
+}
+
 
-  // Step 2: Allocate appropriately sized stuff
+/* Write the labels held in memory to the end of the spill file, creating it
+ * if needed, and empty the in-memory arrays for the labels that follow.
+ *
+ * Labels are found in file order, so every batch spilled is already sorted
+ * and simply follows the one before; the spill file as a whole is the label
+ * table in order, and label j is record j.
+ *
+ * Returns 0 on success.
+ */
+static int spill_labels(fileblock * fb){
+  unsigned int count = fb->label_count - fb->spill_count;
+  spill_record recs[SPILL_PAGE_RECORDS];
+
+  if(fb->spill == NULL){
+    fb->spill = tmpfile();
+    fb->spill_pages = malloc(SPILL_PAGES * sizeof(spill_page));
+    if(fb->spill == NULL || fb->spill_pages == NULL) return 1;
+    for(int p = 0; p < SPILL_PAGES; ++p){
+      fb->spill_pages[p].first = LABEL_NONE;
+      fb->spill_pages[p].count = 0;
+      fb->spill_pages[p].used = 0;
+    }
+  }
+
+  for(unsigned int done = 0; done < count; ){
+    unsigned int n = count - done < SPILL_PAGE_RECORDS ? count - done : SPILL_PAGE_RECORDS;
 
-  size_t total_labels_len = 0;
+    memset(recs, 0, n * sizeof(spill_record));
+    for(unsigned int j = 0; j < n; ++j){
+      recs[j].lab = fb->labels[done + j];
+      recs[j].lab.text = NULL;
+      memcpy(recs[j].text, fb->labels[done + j].text, fb->labels[done + j].length);
+    }
 
-  lt_current = &root;
-  while(lt_current != NULL){
-    for(int j = 0; j < LABELTRACK_SLOTS; ++j)
-      total_labels_len += lt_current->lengths[j];
-    lt_current = lt_current->next;
+    if(write_all(fileno(fb->spill), (const char *)recs, n * sizeof(spill_record))) return 1;
+    done += n;
   }
 
-  DEBUGPRINTD("Total label length", (int)total_labels_len)
+  fb->spill_count = fb->label_count;
+  fb->texts_used = 0;
+  fb->spill_bytes += (unsigned long long)count * sizeof(spill_record);
 
-  fb->label_count = lcount;
-  fb->label_texts = malloc(total_labels_len * sizeof(char));
-  fb->labels = malloc(lcount * sizeof(label));
+  return 0;
+}
 
-  if(fb->label_texts == NULL || fb->labels == NULL){
-    free(fb->label_texts);
-    free(fb->labels);
-    fprintf(stderr, "Error allocating space for labels\n");
-    return 5;
+
+/* Look up a label spilled to disk through the page cache, reading its page
+ * from the spill file if it is not cached, in place of the least recently
+ * used page.
+ *
+ * Returns NULL if the page could not be read.
+ */
+static label * spill_label(fileblock * fb, unsigned int j){
+  unsigned int first = j - j % SPILL_PAGE_RECORDS;
+  spill_page * page = NULL;
+  spill_page * oldest = &fb->spill_pages[0];
+
+  for(int p = 0; p < SPILL_PAGES; ++p){
+    spill_page * sp = &fb->spill_pages[p];
+    if(sp->first == first){
+      page = sp;
+      break;
+    }
+    if(sp->used < oldest->used) oldest = sp;
   }
 
-  // Step 3: Store label information in condensed format
+  // A page read while it was the last, partly filled one may have grown since
+  if(page == NULL || j - first >= page->count){
+    if(page == NULL) page = oldest;
 
-  int ltxt_pos = 0;
-  int current_label = 0;
-  lt_current = &root;
-  while(lt_current != NULL){
-    int lc = lcount - current_label > LABELTRACK_SLOTS
-      ? LABELTRACK_SLOTS
-      : lcount - current_label
-    ;
-    for(int j = 0; j < lc; ++j){
-      label * lab = &fb->labels[current_label];
-      lab->fpos = lt_current->positions[j];
-      lab->length = lt_current->lengths[j];
+    unsigned int count = fb->spill_count - first;
+    if(count > SPILL_PAGE_RECORDS) count = SPILL_PAGE_RECORDS;
 
-      char * tp = fb->label_texts + ltxt_pos;
-      lab->text = tp;
-      memcpy(tp, lt_current->label_texts + j * LABEL_MAX_SIZE, lab->length);
+    // Not a valid page again until the read succeeds
+    page->first = LABEL_NONE;
+    page->count = 0;
 
-      ltxt_pos += lab->length;
-      ++current_label;
+    ssize_t want = (ssize_t)(count * sizeof(spill_record));
+    if(pread(fileno(fb->spill), page->records, (size_t)want, (off_t)first * (off_t)sizeof(spill_record)) != want){
+      perror("Error reading spilled labels");
+      return NULL;
     }
 
-    lt_current = lt_current->next;
+    for(unsigned int r = 0; r < count; ++r)
+      page->records[r].lab.text = page->records[r].text;
+    page->first = first;
+    page->count = count;
+    ++fb->spill_reads;
   }
 
-  // Free labeltrack chain; root is on the stack
-  free_labeltrack_chain(root.next);
-
-  return 0;
+  page->used = ++fb->spill_clock;
+  return &page->records[j - first].lab;
 }
 
 
-/* List the labels contined in the given fileblock to stdout.
+/* Returns the given label, wherever it is kept. Without a memory cap, or for
+ * labels not spilled, this is just &fb->labels[j]. A spilled label comes from
+ * the page cache, and stays valid until SPILL_PAGES - 1 other pages have been
+ * read in after it.
+ *
+ * Returns NULL if a spilled label could not be read back, having printed why.
  */
-void list_fileblock_labels(fileblock * fb){
-  if(fb == NULL) return;
+static label * get_label(fileblock * fb, unsigned int j){
+  if(j >= fb->spill_count) return &fb->labels[j - fb->spill_count];
+  return spill_label(fb, j);
+}
 
-  printf("::: %u labels :::\n", fb->label_count);
 
-  for(unsigned int j = 0; j < fb->label_count; ++j){
-    label * lab = &fb->labels[j];
-    char labuf[LABEL_MAX_SIZE + 1];
+/* Set where the subtree of the given label ends, writing it through to the
+ * spill file if the label has been spilled.
+ *
+ * Returns 0 on success.
+ */
+static int set_label_subtree_end(fileblock * fb, unsigned int j, unsigned int end){
+  if(j >= fb->spill_count){
+    fb->labels[j - fb->spill_count].subtree_end = end;
+    return 0;
+  }
 
-    memcpy(labuf, lab->text, (size_t)lab->length);
-    labuf[lab->length] = '\0';
+  off_t pos = (off_t)j * (off_t)sizeof(spill_record) + (off_t)offsetof(spill_record, lab.subtree_end);
+  if(pwrite(fileno(fb->spill), &end, sizeof(end), pos) != sizeof(end)){
+    perror("Error updating spilled labels");
+    return 1;
+  }
 
-    printf("%3u: %s\n", j, labuf);
+  for(int p = 0; p < SPILL_PAGES; ++p){
+    spill_page * sp = &fb->spill_pages[p];
+    if(sp->first != LABEL_NONE && j - sp->first < sp->count)
+      sp->records[j - sp->first].lab.subtree_end = end;
   }
+
+  return 0;
 }
 
 
-/* Output the text contained in the fileblock from the given label up to the
- * next label. Will output the label line as well.
+/* End the subtrees of all open labels at the given level or deeper, with the
+ * given index being one past their last nested label.
+ *
+ * Returns 0 on success.
  */
-void show_fileblock_section(fileblock * fb, unsigned int label){
-  if(fb == NULL) return;
-  if(label < 0 || label > fb->label_count) return;
+static int close_subtrees(fileblock * fb, unsigned int level, unsigned int end){
+  while(fb->open_depth > 0){
+    unsigned int top = fb->open_sections[fb->open_depth - 1];
+    label * lab = get_label(fb, top);
+    if(lab == NULL) return 1;
+    if(lab->level < level) break;
+    if(set_label_subtree_end(fb, top, end)) return 1;
+    --fb->open_depth;
+  }
+
+  return 0;
+}
+
 
-  long int startpos = fb->labels[label].fpos;
-  long int endpos;
-  long int total;
+/* Add a label at the given index to the section tree: every open label at
+ * the same or a deeper level ends its subtree here, and the innermost label
+ * left open becomes the parent. Called in file order as labels are stored, so
+ * the tree is built in the same pass as the labels. The label itself is
+ * always in memory, having just been stored.
+ *
+ * Returns 0 on success.
+ */
+static int add_label_to_tree(fileblock * fb, unsigned int j){
+  label * lab = get_label(fb, j);
 
-  // TODO: Adjust for delimeter
-  if(label + 1 < fb->label_count)
-    endpos = fb->labels[label + 1].fpos;
-  else
-    endpos = fb->fsize;
+  if(close_subtrees(fb, lab->level, j)) return 1;
 
-  total = endpos - startpos;
+  lab->parent = fb->open_depth > 0 ? fb->open_sections[fb->open_depth - 1] : LABEL_NONE;
+  lab->subtree_end = LABEL_NONE;
 
-  char buf[total];
+  // Open labels have strictly increasing levels, so this cannot overflow
+  fb->open_sections[fb->open_depth++] = j;
 
-  // TODO: Add error handling
-  fseek(fb->fhandle, startpos, SEEK_SET);
-  fread(buf, sizeof(char), total, fb->fhandle);
-  fwrite(buf, sizeof(char), total, stdout);
+  return 0;
 }
 
 
-/* Print out the size of the given file (or so).
- * Returns a negative value on error.
- * May be improved by using e.g. fstat
+/* Close the subtrees of all labels still open at the end of the file.
+ *
+ * Returns 0 on success.
  */
-long int get_file_size(FILE * f){
-  if(f == NULL) return -1L;
+static int close_label_tree(fileblock * fb){
+  lock_labels(fb);
+  int rval = close_subtrees(fb, 0, fb->label_count);
+  if(fb->operations & FB_SCANNER) pthread_cond_broadcast(&fb->found);
+  unlock_labels(fb);
 
-  long int ppos = ftell(f);
+  return rval;
+}
 
-  if(fseek(f, 0, SEEK_END) != 0){
-    perror("Error occurred while seeking");
-    return -1L;
+
+/* Grow the fileblock's label arrays, with the label lock held, to hold at
+ * least the given number of labels and bytes of label text.
+ *
+ * The arrays grow by doubling; when label_texts moves, the text pointers of
+ * the labels already stored are moved along with it.
+ *
+ * Returns 0 on success.
+ */
+static int reserve_label_space(fileblock * fb, unsigned int lcount, size_t text_len){
+  if(lcount > fb->label_capacity){
+    unsigned int cap = fb->label_capacity ? fb->label_capacity : LABELTRACK_SLOTS;
+    while(cap < lcount) cap *= 2;
+    if(fb->mem_labels && cap > fb->mem_labels) cap = lcount > fb->mem_labels ? lcount : fb->mem_labels;
+
+    label * labels = realloc(fb->labels, cap * sizeof(label));
+    if(labels == NULL) return 1;
+    fb->labels = labels;
+    fb->label_capacity = cap;
   }
 
-  long int size = ftell(f);
+  if(text_len > fb->texts_capacity){
+    size_t cap = fb->texts_capacity ? fb->texts_capacity : LABELTRACK_SLOTS * LABEL_MAX_SIZE;
+    size_t max_cap = (size_t)fb->mem_labels * LABEL_MAX_SIZE;
+    while(cap < text_len) cap *= 2;
+    if(fb->mem_labels && cap > max_cap) cap = text_len > max_cap ? text_len : max_cap;
 
-  if(fseek(f, ppos, SEEK_SET) != 0){
-    perror("Error occurred while seeking to reset");
-    // Okay to continue, but position in file has likely changed
+    uintptr_t old_base = (uintptr_t)fb->label_texts;
+    char * texts = realloc(fb->label_texts, cap);
+    if(texts == NULL) return 1;
+
+    if((uintptr_t)texts != old_base){
+      for(unsigned int j = 0; j < fb->label_count - fb->spill_count; ++j)
+        fb->labels[j].text = texts + ((uintptr_t)fb->labels[j].text - old_base);
+    }
+    fb->label_texts = texts;
+    fb->texts_capacity = cap;
   }
 
-  return size;
+  return 0;
 }
 
 
-/* Dump out the contents of the given file.
+/* Move the labels held in the given node into the fileblock's label arrays,
+ * growing them as needed, and empty the node.
+ *
+ * Labels dropped by the filters are not stored, but their delimiters still
+ * end the subtrees of the open labels at their level or deeper, just as the
+ * sections before them end there; a dropped label's subtree is dropped with
+ * it, so the labels nested in it go to the nearest enclosing kept label.
+ *
+ * Returns 0 on success.
  */
-int dump_file_contents(FILE * f){
-  if(f == NULL) return 1;
+static int flush_labeltracker(fileblock * fb, labeltracknode * stage){
+  if(stage->used == 0) return 0;
+
+  size_t text_len = 0;
+  unsigned int kept = 0;
+  for(int j = 0; j < stage->used; ++j){
+    text_len += stage->lengths[j];
+    kept += !stage->dropped[j];
+  }
+
+  lock_labels(fb);
+
+  // Under a memory cap, make room by moving the labels so far to disk
+  if(fb->mem_labels && fb->label_count - fb->spill_count + kept > fb->mem_labels){
+    if(spill_labels(fb)){
+      unlock_labels(fb);
+      return 1;
+    }
+  }
+
+  unsigned int lcount = fb->label_count + kept;
+
+  if(reserve_label_space(fb, lcount - fb->spill_count, fb->texts_used + text_len)){
+    unlock_labels(fb);
+    return 1;
+  }
+
+  // A failure to update spilled tree links is reported once all are stored
+  int rval = 0;
+
+  for(int j = 0, k = 0; j < stage->used; ++j){
+    if(stage->dropped[j]){
+      if(close_subtrees(fb, stage->levels[j], fb->label_count + k)) rval = 1;
+      continue;
+    }
+
+    label * lab = &fb->labels[fb->label_count - fb->spill_count + k];
+    lab->fpos = stage->positions[j];
+    lab->length = stage->lengths[j];
+    lab->stats = stage->stats[j];
+    lab->level = stage->levels[j];
+    lab->text = fb->label_texts + fb->texts_used;
+
+    memcpy(lab->text, stage->label_texts + j * LABEL_MAX_SIZE, lab->length);
+    fb->texts_used += lab->length;
+
+    if(add_label_to_tree(fb, fb->label_count + k)) rval = 1;
+    ++k;
+  }
+
+  fb->label_count = lcount;
+  stage->used = 0;
+
+  if(fb->operations & FB_SCANNER) pthread_cond_broadcast(&fb->found);
+  unlock_labels(fb);
+
+  return rval;
+}
+
+
+/* State shared with the parser callbacks while filling labeltrackers.
+ */
+typedef struct {
+  fileblock      * fb;         // Fileblock the labels are flushed into
+  labeltracknode * stage;      // Labels found but not yet flushed
+  char             flush_each; // Flush labels as soon as their section closes
+  char             failed;     // Set if flushing labels failed
+  char             open;       // Whether the last staged label's section is open
+  unsigned int     dropped;    // Number of labels dropped by the filters
+  const char     * chunk;      // Chunk of the file being fed to the parser
+  long int         chunk_pos;  // Offset of the chunk in the file
+  long int         stats_pos;  // Offset of the first byte not yet in acc
+  section_accum    acc;        // Stats of the section being scanned
+  section_accum    delim_acc;  // Snapshot of acc where a line that may be a
+                               // delimiter line began in an earlier chunk
+  long int         lines_pos;  // Offset of the first byte not yet in lines
+  unsigned long    lines;      // Newlines seen so far, for the line index
+  unsigned long    section_line; // Newlines before the open section
+} labeltrack_ctx;
+
+
+/* Add a sample to the fileblock's line index.
+ *
+ * Returns 0 on success.
+ */
+static int add_line_sample(fileblock * fb, long int fpos, unsigned long line){
+  int rval = 0;
+
+  lock_labels(fb);
+
+  if(fb->line_sample_count == fb->line_sample_capacity){
+    size_t cap = fb->line_sample_capacity ? 2 * fb->line_sample_capacity : 64;
+    line_sample * samples = realloc(fb->line_samples, cap * sizeof(line_sample));
+    if(samples == NULL){
+      rval = 1;
+    } else {
+      fb->line_samples = samples;
+      fb->line_sample_capacity = cap;
+    }
+  }
+
+  if(rval == 0){
+    fb->line_samples[fb->line_sample_count].fpos = fpos;
+    fb->line_samples[fb->line_sample_count].line = line;
+    ++fb->line_sample_count;
+  }
+
+  unlock_labels(fb);
+
+  return rval;
+}
+
+
+/* Count the newlines in the current chunk up to the given offset with
+ * memchr, recording where every LINE_SAMPLE_INTERVAL'th line starts. This is
+ * the only place newlines are counted during a scan; section line counts are
+ * taken from it too.
+ *
+ * Returns 0 on success.
+ */
+static int count_lines_to(labeltrack_ctx * lc, long int pos){
+  if(pos <= lc->lines_pos) return 0;
+
+  const char * p = lc->chunk + (lc->lines_pos - lc->chunk_pos);
+  const char * end = lc->chunk + (pos - lc->chunk_pos);
+  lc->lines_pos = pos;
+
+  while((p = memchr(p, '\n', (size_t)(end - p))) != NULL){
+    ++p;
+    if(++lc->lines % LINE_SAMPLE_INTERVAL == 0){
+      long int fpos = lc->chunk_pos + (long int)(p - lc->chunk);
+      if(add_line_sample(lc->fb, fpos, lc->lines)) return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Add the bytes of the current chunk up to the given offset to the running
+ * section stats.
+ */
+static void labeltrack_accumulate_to(labeltrack_ctx * lc, long int pos){
+  if(pos <= lc->stats_pos) return;
+  accumulate_section_stats(
+    &lc->acc,
+    lc->chunk + (lc->stats_pos - lc->chunk_pos),
+    (size_t)(pos - lc->stats_pos)
+  );
+  lc->stats_pos = pos;
+}
+
+
+/* Parser callback for the start of a label line: closes off the previous
+ * section's stats as of the start of the delimiter, flushes the staged labels
+ * if due, then records the new label's position.
+ */
+static void labeltrack_label_start(void * ctx, long int fpos, long int delim_pos, unsigned int level){
+  labeltrack_ctx * lc = ctx;
+  labeltracknode * stage = lc->stage;
+
+  DEBUGPRINTD_V("Label transition at", (int)fpos)
+
+  // If the delimiter line began in an earlier chunk, its bytes were already
+  // accumulated, and delim_acc was taken at its start
+  if(lc->open){
+    section_stats * stats = &stage->stats[stage->used - 1];
+    if(delim_pos >= lc->stats_pos){
+      labeltrack_accumulate_to(lc, delim_pos);
+      *stats = section_accum_stats(&lc->acc);
+    } else {
+      *stats = section_accum_stats(&lc->delim_acc);
+    }
+
+    // There is no newline between an earlier chunk and delim_pos
+    if(count_lines_to(lc, delim_pos)) lc->failed = 1;
+    stats->lines = (unsigned int)(lc->lines - lc->section_line);
+  }
+  reset_section_accum(&lc->acc);
+  lc->stats_pos = fpos;
+  if(count_lines_to(lc, fpos)) lc->failed = 1;
+  lc->section_line = lc->lines;
+
+  // Every staged label now has a complete section
+  if(stage->used == LABELTRACK_SLOTS || lc->flush_each){
+    if(flush_labeltracker(lc->fb, stage)){
+      // If the labels could not be stored, keep overwriting the last slot;
+      // the caller will see the failure
+      lc->failed = 1;
+      if(stage->used == LABELTRACK_SLOTS) --stage->used;
+    }
+  }
+
+  stage->positions[stage->used] = fpos;
+  stage->lengths[stage->used] = 0;
+  stage->levels[stage->used] = (unsigned char)level;
+  stage->dropped[stage->used] = 0;
+  ++stage->used;
+  lc->open = 1;
+}
+
+
+/* Returns nonzero if the given label text matches one of the fileblock's
+ * filters, or if there are no filters.
+ */
+static int label_passes_filters(fileblock * fb, const char * text, unsigned int length){
+  if(fb->filter_count == 0) return 1;
+
+  char labuf[LABEL_MAX_SIZE + 1];
+  memcpy(labuf, text, length);
+  labuf[length] = '\0';
+
+  for(unsigned int j = 0; j < fb->filter_count; ++j)
+    if(regexec(&fb->filters[j], labuf, 0, NULL, 0) == 0) return 1;
+
+  return 0;
+}
+
+
+/* Parser callback for a completed label line: stores the text, or drops the
+ * label if it does not pass the filters. A dropped label still ended the
+ * section before it, so extents of the kept labels are unaffected.
+ */
+static void labeltrack_label_end(void * ctx, long int fpos, const char * text, unsigned int length){
+  labeltrack_ctx * lc = ctx;
+  labeltracknode * stage = lc->stage;
+  int slot = stage->used - 1;
+
+  if(length > LABEL_MAX_SIZE) length = LABEL_MAX_SIZE;
+
+  // The slot stays, as the dropped label's delimiter still closes subtrees
+  if(!label_passes_filters(lc->fb, text, length)){
+    stage->dropped[slot] = 1;
+    lc->open = 0;
+    ++lc->dropped;
+    return;
+  }
+  memcpy(stage->label_texts + LABEL_MAX_SIZE * slot, text, length);
+  stage->lengths[slot] = length;
+
+  DEBUGPRINT_V("Finished label")
+}
+
+
+/* Reads the labels from the given fileblock's file and stores them into the
+ * fileblock, using the given node to stage labels until they are flushed in
+ * batches. In lazy mode, each label is flushed as soon as its section is
+ * complete, so readers waiting on it can carry on.
+ *
+ * If the fileblock has label filters, only the labels matching them are
+ * stored, each evaluated once as soon as its text is complete.
+ *
+ * This function uses the buf in the fileblock if available, and otherwise
+ * reads with pread so it does not disturb the position of fhandle. The file
+ * contents are pushed through an sm_parser, which keeps track of label
+ * offsets itself.
+ *
+ * Section statistics are gathered in the same pass: every byte read is also
+ * fed to a section accumulator, which is closed off into the stats slot of
+ * the preceding label whenever a new label is found. Newlines are counted
+ * once per chunk with memchr, which gives both the sections' line counts and
+ * the line index.
+ *
+ * Returns the number of labels found on success, or a negative number on error.
+ */
+int fill_labeltrackers(fileblock * fb, labeltracknode * stage){
+  if(fb == NULL) return -1;
+  if(stage == NULL) return -1;
+  if(fb->table == NULL) return -1;
+  if(!(fb->operations & FB_INITIALIZED)) return -2;
+
+  int fd = fileno(fb->fhandle);
+  char * buf;
+  char using_fb_buf;
+  long int bufsize = 0;
+
+  // Use fb buf if available, otherwise allocate buffer
+  if(fb->buf == NULL){
+    using_fb_buf = 0;
+    bufsize = SCAN_BUF_SIZE;
+    buf = malloc(bufsize * sizeof(char));
+  } else {
+    using_fb_buf = 1;
+    bufsize = fb->fsize;
+    buf = fb->buf;
+  }
+
+  if(buf == NULL){
+    fprintf(stderr, "Error allocating buffer to load labels\n");
+    return -3;
+  }
+
+  labeltrack_ctx lc = {
+    .fb = fb,
+    .stage = stage,
+    .flush_each = fb->lazy,
+    .chunk = buf,
+  };
+  reset_section_accum(&lc.acc);
+  stage->used = 0;
+
+  sm_callbacks cb = {
+    .label_start = labeltrack_label_start,
+    .label_end = labeltrack_label_end,
+    .ctx = &lc,
+  };
+  sm_parser parser;
+  sm_parser_init(&parser, fb->table, &cb);
+
+  // Read chunks of the file and push them through the parser
+  while(1){
+    ssize_t read;
+
+    // Fill buffer as needed, set size of data
+    if(!using_fb_buf){
+      read = pread(fd, buf, bufsize, parser.offset);
+      if(read < 0){
+        perror("Error reading file to get label count");
+        free(buf);
+        return -4;
+      }
+      if(read == 0) break;
+    } else {
+      read = fb->fsize;
+    }
+
+    lc.chunk_pos = parser.offset;
+    sm_parser_feed(&parser, buf, read);
+
+    // Keep a snapshot where a delimiter line might be continuing into the
+    // next chunk, as its bytes cannot be accumulated later
+    long int delim_line = sm_parser_delim_line(&parser);
+    if(delim_line >= lc.stats_pos){
+      labeltrack_accumulate_to(&lc, delim_line);
+      lc.delim_acc = lc.acc;
+    }
+    labeltrack_accumulate_to(&lc, parser.offset);
+    if(count_lines_to(&lc, parser.offset)) lc.failed = 1;
+
+    // If using fb buf, all of file done in one go
+    if(using_fb_buf) break;
+
+    // Give up if the fileblock is being closed under a background scan
+    if(fb->operations & FB_SCANNER){
+      char stop;
+      pthread_mutex_lock(&fb->lock);
+      stop = fb->stop_scan;
+      pthread_mutex_unlock(&fb->lock);
+      if(stop) break;
+    }
+  }
+
+  sm_parser_finish(&parser);
+
+  // Last section runs to the end of what was read
+  if(lc.open){
+    stage->stats[stage->used - 1] = section_accum_stats(&lc.acc);
+    stage->stats[stage->used - 1].lines = (unsigned int)(lc.lines - lc.section_line);
+  }
+  if(flush_labeltracker(fb, stage)) lc.failed = 1;
+  if(close_label_tree(fb)) lc.failed = 1;
+
+  // Free buffer if we allocated our own
+  if(!using_fb_buf) free(buf);
+
+  if(lc.failed){
+    fprintf(stderr, "Error storing labels or line index\n");
+    return -5;
+  }
+
+  lock_labels(fb);
+  unsigned int lcount = fb->label_count;
+  unlock_labels(fb);
+
+  DEBUGPRINTD("Found labels", lcount)
+  if(fb->filter_count) DEBUGPRINTD("Labels dropped by filters", (int)lc.dropped)
+
+  return lcount;
+}
+
+
+/* Reads the labels from the configured file in the provided initialized
+ * fileblock and stores them properly into said fileblock.
+ *
+ * This function uses the buf in the fileblock if available.
+ */
+int load_fileblock_labels(fileblock * fb){
+  if(fb == NULL) return 1;
+  if(!(fb->operations & FB_INITIALIZED)) return 2;
+  if(fb->operations & FB_LOADED_LABELS) return 3;
+
+  labeltracknode stage = {0};
+
+  // Step 1: Get labels, staged through a labeltrack node
+
+  int lcount = fill_labeltrackers(fb, &stage);
+  DEBUGPRINTD_V("Got labels", lcount)
+  if(lcount < 0){
+    fprintf(stderr, "Error occured in getting label info\n");
+    return 4;
+  } else if(lcount == 0) {
+    DEBUGPRINT("No labels found")
+    // Not an error condition, nothing further to do
+    return 0;
+  }
+
+  DEBUGPRINTD("Label text held in memory", (int)fb->texts_used)
+
+  if(fb->spill_count)
+    fprintf(stderr, "Spilled %u labels (%llu bytes) to disk to stay within the memory cap\n",
+      fb->spill_count, fb->spill_bytes);
+
+  // Step 2: Build search structures over the stored labels, which would not
+  // fit within a memory cap; searching then scans every label instead
+
+  if(!fb->mem_cap && build_label_search(fb))
+    fprintf(stderr, "Error building label search index, searching will be slow\n");
+
+  fb->operations |= FB_LOADED_LABELS;
+
+  return 0;
+}
+
+
+/* Body of the background scanner thread used in lazy mode.
+ */
+static void * fileblock_scan_thread(void * arg){
+  fileblock * fb = arg;
+  labeltracknode stage = {0};
+
+  int lcount = fill_labeltrackers(fb, &stage);
+  if(lcount < 0)
+    fprintf(stderr, "Error occured in background label scan (%d)\n", lcount);
+
+  pthread_mutex_lock(&fb->lock);
+  char stopped = fb->stop_scan;
+  pthread_mutex_unlock(&fb->lock);
+
+  // The labels are final from here on, so the search structures can be built
+  // from them without the lock while readers carry on
+  if(lcount > 0 && !stopped){
+    if(build_label_search(fb))
+      fprintf(stderr, "Error building label search index, searching will be slow\n");
+  }
+
+  pthread_mutex_lock(&fb->lock);
+  fb->scanning = 0;
+  if(lcount >= 0 && !stopped) fb->operations |= FB_LOADED_LABELS;
+  pthread_cond_broadcast(&fb->found);
+  pthread_mutex_unlock(&fb->lock);
+
+  return NULL;
+}
+
+
+/* Start a background scan for labels in the provided initialized fileblock.
+ * Labels become available in the fileblock as they are found; readers should
+ * take the label lock, and use wait_for_labels to wait for the ones they need.
+ *
+ * Returns 0 on success.
+ */
+int start_fileblock_scan(fileblock * fb){
+  if(fb == NULL) return 1;
+  if(!(fb->operations & FB_INITIALIZED)) return 2;
+  if(fb->operations & (FB_LOADED_LABELS | FB_SCANNER)) return 3;
+
+  if(pthread_mutex_init(&fb->lock, NULL) != 0) return 4;
+  if(pthread_cond_init(&fb->found, NULL) != 0){
+    pthread_mutex_destroy(&fb->lock);
+    return 4;
+  }
+
+  fb->scanning = 1;
+  fb->stop_scan = 0;
+  fb->operations |= FB_SCANNER;
+
+  if(pthread_create(&fb->scanner, NULL, fileblock_scan_thread, fb) != 0){
+    fb->operations &= ~(FB_SCANNER);
+    fb->scanning = 0;
+    pthread_cond_destroy(&fb->found);
+    pthread_mutex_destroy(&fb->lock);
+    return 5;
+  }
+
+  return 0;
+}
+
+
+/* List the labels contined in the given fileblock to stdout, along with the
+ * size, line count, word count and content hash of each section. Nested
+ * labels are indented by level.
+ *
+ * During a background scan, only the labels found so far are listed.
+ */
+void list_fileblock_labels(fileblock * fb){
+  if(fb == NULL) return;
+
+  lock_labels(fb);
+
+  printf("::: %s%u labels :::\n", fb->scanning ? "at least " : "", fb->label_count);
+  printf("%3s  %-24s %10s %8s %8s  %s\n", "#", "label", "bytes", "lines", "words", "hash");
+
+  for(unsigned int j = 0; j < fb->label_count; ++j){
+    label * lab = get_label(fb, j);
+    if(lab == NULL) break;
+
+    char labuf[2 * SM_MAX_LEVELS + LABEL_MAX_SIZE + 1];
+    unsigned int indent = 2 * lab->level;
+
+    // Nested labels are indented under their parents
+    memset(labuf, ' ', indent);
+    memcpy(labuf + indent, lab->text, (size_t)lab->length);
+    labuf[indent + lab->length] = '\0';
+
+    printf(
+      "%3u: %-24s %10ld %8u %8u  %016llx\n",
+      j, labuf,
+      lab->stats.bytes,
+      lab->stats.lines,
+      lab->stats.words,
+      lab->stats.hash
+    );
+  }
+
+  unlock_labels(fb);
+}
+
+
+/* A batch of neighbouring labels close enough to be read with one pread,
+ * and the previews made for them.
+ */
+typedef struct {
+  unsigned int     first;       // First label in the batch
+  unsigned int     count;       // Number of labels in the batch
+  char             ready;       // Set once the previews have been made
+  unsigned char    lengths[PREVIEW_BATCH_LABELS];
+  char             previews[PREVIEW_BATCH_LABELS * PREVIEW_BYTES];
+} preview_batch;
+
+
+/* Shared state of the workers gathering section previews. Batches are taken
+ * in file order and read into a ring of PREVIEW_RING slots; a slot is only
+ * reused once its batch has been listed, so the workers stay at most that far
+ * ahead of the listing.
+ */
+typedef struct {
+  fileblock      * fb;
+  preview_batch  * ring;        // PREVIEW_RING batch slots
+  unsigned int     next_label;  // First label not yet in a batch
+  unsigned int     next_batch;  // Number of batches taken
+  unsigned int     printed;     // Number of batches listed
+  pthread_mutex_t  lock;        // Guards all of the above and the slots' ready
+  pthread_cond_t   changed;     // Signalled when a batch is made or listed
+  char             failed;      // Set if any read failed
+} preview_job;
+
+
+/* Make the preview of a section from the start of its text: the lines after
+ * the label line, up to PREVIEW_LINES of them, joined by " | " and cut short
+ * at PREVIEW_BYTES. Control characters are shown as spaces.
+ *
+ * Returns the length of the preview.
+ */
+static unsigned int make_preview(const char * text, size_t len, char * out){
+  const char * nl = memchr(text, '\n', len);
+  if(nl == NULL) return 0;
+
+  const char * p = nl + 1;
+  const char * end = text + len;
+  unsigned int used = 0;
+  unsigned int lines = 0;
+
+  while(p < end && used < PREVIEW_BYTES){
+    char c = *p++;
+
+    if(c == '\n'){
+      if(++lines == PREVIEW_LINES || p == end) break;
+      for(const char * sep = " | "; *sep && used < PREVIEW_BYTES; ++sep)
+        out[used++] = *sep;
+    } else {
+      out[used++] = (unsigned char)c < ' ' ? ' ' : c;
+    }
+  }
+
+  return used;
+}
+
+
+/* Take the next batch of labels, if there are any left and a ring slot is
+ * free for it. Called with the job lock held.
+ *
+ * Returns the batch's slot, or NULL if none could be taken.
+ */
+static preview_batch * take_preview_batch(preview_job * job){
+  fileblock * fb = job->fb;
+
+  if(job->failed || job->next_label >= fb->label_count) return NULL;
+  if(job->next_batch - job->printed >= PREVIEW_RING) return NULL;
+
+  preview_batch * batch = &job->ring[job->next_batch++ % PREVIEW_RING];
+  unsigned int first = job->next_label;
+  unsigned int last = first + 1;
+
+  while(last < fb->label_count && last - first < PREVIEW_BATCH_LABELS
+  && fb->labels[last].fpos - fb->labels[first].fpos <= PREVIEW_BATCH_SPAN
+  ) ++last;
+
+  batch->first = first;
+  batch->count = last - first;
+  batch->ready = 0;
+  job->next_label = last;
+
+  return batch;
+}
+
+
+/* Make the previews of a batch taken with take_preview_batch, from the
+ * whole-file buffer if there is one and otherwise with a single pread into
+ * buf, which must hold PREVIEW_BATCH_SPAN + PREVIEW_READ bytes. Called
+ * without the job lock held.
+ */
+static void fill_preview_batch(preview_job * job, preview_batch * batch, char * buf){
+  fileblock * fb = job->fb;
+  unsigned int first = batch->first;
+  unsigned int last = first + batch->count;
+  long int start = fb->labels[first].fpos;
+  long int end = fb->labels[last - 1].fpos + PREVIEW_READ;
+  if(end > fb->fsize) end = fb->fsize;
+
+  ssize_t got = end - start;
+  if(fb->buf != NULL) buf = fb->buf + start;
+  else got = pread(fileno(fb->fhandle), buf, (size_t)(end - start), start);
+
+  if(got >= 0){
+    for(unsigned int j = first; j < last; ++j){
+      label * lab = &fb->labels[j];
+      long int off = lab->fpos - start;
+      long int len = lab->stats.bytes < PREVIEW_READ ? lab->stats.bytes : PREVIEW_READ;
+      if(off + len > got) len = off < got ? got - off : 0;
+
+      batch->lengths[j - first] = (unsigned char)make_preview(buf + off, (size_t)len, batch->previews + (size_t)(j - first) * PREVIEW_BYTES);
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  if(got < 0) job->failed = 1;
+  batch->ready = 1;
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+}
+
+
+/* Body of a preview worker thread.
+ */
+static void * preview_thread(void * arg){
+  preview_job * job = arg;
+  char * buf = malloc(PREVIEW_BATCH_SPAN + PREVIEW_READ);
+
+  pthread_mutex_lock(&job->lock);
+  if(buf == NULL) job->failed = 1;
+
+  while(!job->failed && job->next_label < job->fb->label_count){
+    preview_batch * batch = take_preview_batch(job);
+    if(batch == NULL){
+      // Every slot is waiting to be listed
+      pthread_cond_wait(&job->changed, &job->lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&job->lock);
+    fill_preview_batch(job, batch, buf);
+    pthread_mutex_lock(&job->lock);
+  }
+
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+
+  free(buf);
+  return NULL;
+}
+
+
+/* Print the labels of a batch along with their previews.
+ */
+static void print_preview_batch(fileblock * fb, const preview_batch * batch){
+  for(unsigned int k = 0; k < batch->count; ++k){
+    unsigned int j = batch->first + k;
+    label * lab = &fb->labels[j];
+    char labuf[2 * SM_MAX_LEVELS + LABEL_MAX_SIZE + 1];
+    unsigned int indent = 2 * lab->level;
+
+    memset(labuf, ' ', indent);
+    memcpy(labuf + indent, lab->text, (size_t)lab->length);
+    labuf[indent + lab->length] = '\0';
+
+    printf(
+      "%3u: %-24s %.*s%s\n",
+      j, labuf,
+      (int)batch->lengths[k], batch->previews + (size_t)k * PREVIEW_BYTES,
+      batch->lengths[k] == PREVIEW_BYTES ? "..." : ""
+    );
+  }
+}
+
+
+/* List the labels along with the first lines of each section.
+ *
+ * Without a whole-file buffer, worker threads read the starts of the sections
+ * with preads in parallel, each covering a batch of neighbouring sections, so
+ * that a cold file is read with many reads in flight instead of one seek at a
+ * time. Batches are listed in order as soon as they are read, and the workers
+ * run at most PREVIEW_RING batches ahead, so memory use does not grow with the
+ * number of labels.
+ */
+void list_fileblock_previews(fileblock * fb){
+  if(fb == NULL) return;
+  if(wait_for_scan(fb)){
+    printf("Label scan was stopped\n");
+    return;
+  }
+
+  preview_job job = { .fb = fb };
+  char * buf = NULL;
+
+  job.ring = malloc(PREVIEW_RING * sizeof(preview_batch));
+  if(fb->buf == NULL) buf = malloc(PREVIEW_BATCH_SPAN + PREVIEW_READ);
+  if(job.ring == NULL || (fb->buf == NULL && buf == NULL)){
+    fprintf(stderr, "Error allocating space for previews\n");
+    free(job.ring);
+    free(buf);
+    return;
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.changed, NULL);
+
+  // Reading from the buffer is quick enough without any workers
+  long int nthreads = 0;
+  if(fb->buf == NULL){
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads < PREVIEW_MIN_THREADS) nthreads = PREVIEW_MIN_THREADS;
+    if(nthreads > PREVIEW_MAX_THREADS) nthreads = PREVIEW_MAX_THREADS;
+  }
+
+  pthread_t threads[PREVIEW_MAX_THREADS];
+  long int started = 0;
+
+  while(started < nthreads && pthread_create(&threads[started], NULL, preview_thread, &job) == 0)
+    ++started;
+
+  printf("::: %u labels :::\n", fb->label_count);
+
+  pthread_mutex_lock(&job.lock);
+  while(!job.failed && (job.printed < job.next_batch || job.next_label < fb->label_count)){
+    preview_batch * batch = &job.ring[job.printed % PREVIEW_RING];
+
+    if(job.printed < job.next_batch && batch->ready){
+      pthread_mutex_unlock(&job.lock);
+      print_preview_batch(fb, batch);
+      pthread_mutex_lock(&job.lock);
+
+      ++job.printed;
+      pthread_cond_broadcast(&job.changed);
+      continue;
+    }
+
+    // Help out while waiting, which also covers thread creation failing
+    batch = take_preview_batch(&job);
+    if(batch != NULL){
+      pthread_mutex_unlock(&job.lock);
+      fill_preview_batch(&job, batch, buf);
+      pthread_mutex_lock(&job.lock);
+    } else {
+      pthread_cond_wait(&job.changed, &job.lock);
+    }
+  }
+  char failed = job.failed;
+  pthread_mutex_unlock(&job.lock);
+
+  for(long int t = 0; t < started; ++t)
+    pthread_join(threads[t], NULL);
+
+  if(failed) fprintf(stderr, "Error reading section previews\n");
+
+  pthread_cond_destroy(&job.changed);
+  pthread_mutex_destroy(&job.lock);
+  free(job.ring);
+  free(buf);
+}
+
+
+/* Output the text contained in the fileblock from the given label up to the
+ * next label's delimiter line. Will output the label line as well.
+ *
+ * During a background scan, this waits only until the given label's section
+ * is complete.
+ */
+void show_fileblock_section(fileblock * fb, unsigned int lnum){
+  if(fb == NULL) return;
+
+  lock_labels(fb);
+  unsigned int lcount = wait_for_labels(fb, lnum + 1);
+  if(lnum >= lcount){
+    unlock_labels(fb);
+    printf("No such label, only %u found\n", lcount);
+    return;
+  }
+
+  label * lab = get_label(fb, lnum);
+  long int startpos = lab ? lab->fpos : 0;
+  long int total = lab ? lab->stats.bytes : 0;
+  unlock_labels(fb);
+  if(lab == NULL) return;
+
+  print_file_range(fb, startpos, total);
+}
+
+
+/* Wait, with the label lock held, until the subtree of the given label is
+ * complete, or the background scan has finished.
+ *
+ * Returns nonzero if the label exists.
+ */
+static int wait_for_subtree(fileblock * fb, unsigned int lnum){
+  if(lnum >= wait_for_labels(fb, lnum + 1)) return 0;
+
+  if(fb->operations & FB_SCANNER){
+    while(fb->scanning){
+      label * lab = get_label(fb, lnum);
+      if(lab == NULL) return -1;
+      if(lab->subtree_end != LABEL_NONE) break;
+      pthread_cond_wait(&fb->found, &fb->lock);
+    }
+  }
+
+  return 1;
+}
+
+
+/* Returns the file offset where the subtree of the given label ends, being the
+ * end of the section of its last nested label. A subtree still open during a
+ * background scan extends as far as anything found so far.
+ */
+static long int subtree_end_pos(fileblock * fb, unsigned int lnum){
+  label * lab = get_label(fb, lnum);
+  if(lab == NULL) return -1;
+
+  unsigned int end = lab->subtree_end;
+  if(end == LABEL_NONE) return LONG_MAX;
+
+  label * last = get_label(fb, end - 1);
+  if(last == NULL) return -1;
+  return last->fpos + last->stats.bytes;
+}
+
+
+/* Output the text of the given label's section along with all sections nested
+ * within it, as one contiguous range of the file.
+ */
+void show_fileblock_subtree(fileblock * fb, unsigned int lnum){
+  if(fb == NULL) return;
+
+  lock_labels(fb);
+  int found = wait_for_subtree(fb, lnum);
+  unsigned int lcount = fb->label_count;
+  if(found <= 0){
+    unlock_labels(fb);
+    if(found == 0) printf("No such label, only %u found\n", lcount);
+    return;
+  }
+
+  long int endpos = subtree_end_pos(fb, lnum);
+  label * lab = get_label(fb, lnum);
+  long int startpos = lab ? lab->fpos : 0;
+  unlock_labels(fb);
+  if(lab == NULL || endpos < 0) return;
+
+  print_file_range(fb, startpos, endpos - startpos);
+}
+
+
+/* List the labels directly nested within the given label. Each child's
+ * subtree is skipped over in one step, so this takes one step per child.
+ */
+void list_fileblock_children(fileblock * fb, unsigned int lnum){
+  if(fb == NULL) return;
+
+  lock_labels(fb);
+  int found = wait_for_subtree(fb, lnum);
+  unsigned int lcount = fb->label_count;
+  if(found <= 0){
+    unlock_labels(fb);
+    if(found == 0) printf("No such label, only %u found\n", lcount);
+    return;
+  }
+
+  label * parent = get_label(fb, lnum);
+  if(parent == NULL){
+    unlock_labels(fb);
+    return;
+  }
+  printf("::: Sections in %.*s :::\n", (int)parent->length, parent->text);
+
+  unsigned int end = parent->subtree_end;
+  unsigned int c = lnum + 1;
+  while(c < end){
+    long int endpos = subtree_end_pos(fb, c);
+    label * lab = get_label(fb, c);
+    if(lab == NULL || endpos < 0) break;
+
+    printf(
+      "%3u: %-24.*s %10ld bytes, %u nested\n",
+      c, (int)lab->length, lab->text,
+      endpos - lab->fpos,
+      lab->subtree_end - c - 1
+    );
+    c = lab->subtree_end;
+  }
+
+  unlock_labels(fb);
+}
+
+
+/* Print the chain of sections containing the given file offset, outermost
+ * first. The innermost label at or before the offset is found by binary
+ * search over the label positions, then its ancestors are walked up until one
+ * whose subtree covers the offset.
+ */
+void find_fileblock_offset(fileblock * fb, long int offset){
+  if(fb == NULL) return;
+
+  lock_labels(fb);
+
+  // Wait until the labels found reach past the offset
+  if(fb->operations & FB_SCANNER){
+    while(fb->scanning){
+      if(fb->label_count > 0){
+        label * last = get_label(fb, fb->label_count - 1);
+        if(last == NULL) goto done;
+        if(last->fpos > offset) break;
+      }
+      pthread_cond_wait(&fb->found, &fb->lock);
+    }
+  }
+
+  unsigned int lo = 0, hi = fb->label_count;
+  while(lo < hi){
+    unsigned int mid = lo + (hi - lo) / 2;
+    label * lab = get_label(fb, mid);
+    if(lab == NULL) goto done;
+
+    if(lab->fpos <= offset) lo = mid + 1;
+    else hi = mid;
+  }
+
+  // Innermost label covering the offset; its own section, or some subtree
+  unsigned int c = lo > 0 ? lo - 1 : LABEL_NONE;
+  label * inner = c != LABEL_NONE ? get_label(fb, c) : NULL;
+  if(c != LABEL_NONE && inner == NULL) goto done;
+  if(c != LABEL_NONE && offset >= inner->fpos + inner->stats.bytes){
+    while(c != LABEL_NONE){
+      long int endpos = subtree_end_pos(fb, c);
+      label * lab = get_label(fb, c);
+      if(lab == NULL || endpos < 0) goto done;
+      if(offset < endpos) break;
+      c = lab->parent;
+    }
+  }
+
+  if(c == LABEL_NONE){
+    printf("Offset %ld is not within any labeled section\n", offset);
+    goto done;
+  }
+
+  unsigned int chain[SM_MAX_LEVELS];
+  unsigned int depth = 0;
+  while(c != LABEL_NONE && depth < SM_MAX_LEVELS){
+    label * lab = get_label(fb, c);
+    if(lab == NULL) goto done;
+
+    chain[depth++] = c;
+    c = lab->parent;
+  }
+
+  label * innermost = get_label(fb, chain[0]);
+  if(innermost == NULL) goto done;
+
+  long int line = line_of_offset(fb, offset);
+  long int section_line = line - line_of_offset(fb, innermost->fpos);
+
+  printf("Offset %ld is on line %ld, line %ld of its section, within:\n",
+    offset, line + 1, section_line + 1);
+  while(depth > 0){
+    label * lab = get_label(fb, chain[--depth]);
+    if(lab == NULL) break;
+    printf(
+      "%3u: %*s%.*s (starts at %ld, line %ld)\n",
+      chain[depth], 2 * (int)lab->level, "",
+      (int)lab->length, lab->text, lab->fpos,
+      line_of_offset(fb, lab->fpos) + 1
+    );
+  }
+
+done:
+  unlock_labels(fb);
+}
+
+
+/* Find the last line index sample at or before the given offset, or the given
+ * line, whichever is given as nonnegative. Called with the label lock held.
+ */
+static line_sample nearest_line_sample(fileblock * fb, long int offset, long int line){
+  line_sample start = {0, 0};
+  size_t lo = 0, hi = fb->line_sample_count;
+
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    line_sample * ls = &fb->line_samples[mid];
+    if(offset >= 0 ? ls->fpos <= offset : ls->line <= (unsigned long)line) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if(lo > 0) start = fb->line_samples[lo - 1];
+  return start;
+}
+
+
+/* Returns the number of the line containing the given offset, counting from
+ * 0, or -1 on error. Only the newlines after the nearest line index sample
+ * are counted, so at most LINE_SAMPLE_INTERVAL lines are read. Called with
+ * the label lock held.
+ */
+static long int line_of_offset(fileblock * fb, long int offset){
+  line_sample start = nearest_line_sample(fb, offset, -1);
+  long int line = (long int)start.line;
+  long int pos = start.fpos;
+  char buf[SCAN_BUF_SIZE / 16];
+
+  while(pos < offset){
+    size_t want = offset - pos < (long int)sizeof(buf) ? (size_t)(offset - pos) : sizeof(buf);
+    ssize_t got = pread(fileno(fb->fhandle), buf, want, pos);
+    if(got <= 0) return -1;
+
+    const char * p = buf;
+    const char * end = buf + got;
+    while((p = memchr(p, '\n', (size_t)(end - p))) != NULL){
+      ++p;
+      ++line;
+    }
+    pos += got;
+  }
+
+  return line;
+}
+
+
+/* Returns the offset where the given line starts, counting from 0, or the file
+ * size if the file ends first. As with line_of_offset, only the lines after
+ * the nearest line index sample are read. Called with the label lock held.
+ */
+static long int offset_of_line(fileblock * fb, long int line){
+  if(line <= 0) return 0;
+
+  line_sample start = nearest_line_sample(fb, -1, line);
+  long int need = line - (long int)start.line;
+  long int pos = start.fpos;
+  char buf[SCAN_BUF_SIZE / 16];
+
+  while(need > 0 && pos < fb->fsize){
+    ssize_t got = pread(fileno(fb->fhandle), buf, sizeof(buf), pos);
+    if(got <= 0) break;
+
+    const char * p = buf;
+    const char * end = buf + got;
+    while(need > 0 && (p = memchr(p, '\n', (size_t)(end - p))) != NULL){
+      ++p;
+      --need;
+    }
+
+    pos += need > 0 ? got : (long int)(p - buf);
+  }
+
+  return need > 0 ? fb->fsize : pos;
+}
+
+
+/* Output the given lines of a label's section, counting the label line as line
+ * 1, with both ends inclusive. The line index locates both ends, so only the
+ * requested range is read, not the whole section.
+ */
+void show_fileblock_lines(fileblock * fb, unsigned int lnum, long int first, long int last){
+  if(fb == NULL) return;
+  if(first < 1 || last < first) return;
+
+  lock_labels(fb);
+  unsigned int lcount = wait_for_labels(fb, lnum + 1);
+  if(lnum >= lcount){
+    unlock_labels(fb);
+    printf("No such label, only %u found\n", lcount);
+    return;
+  }
+
+  label * lab = get_label(fb, lnum);
+  if(lab == NULL){
+    unlock_labels(fb);
+    return;
+  }
+
+  // Lines past the section's last newline can only be an unterminated last
+  // line, so the range is cut short there before finding any offsets
+  long int section_lines = (long int)lab->stats.lines + 1;
+  if(first > section_lines){
+    unlock_labels(fb);
+    printf("Section has fewer than %ld lines\n", first);
+    return;
+  }
+  if(last > section_lines) last = section_lines;
+
+  long int section_start = lab->fpos;
+  long int section_end = section_start + lab->stats.bytes;
+  long int line = line_of_offset(fb, section_start);
+
+  long int start = line < 0 ? -1 : offset_of_line(fb, line + first - 1);
+  long int end = line < 0 ? -1 : offset_of_line(fb, line + last);
+  unlock_labels(fb);
+
+  if(line < 0){
+    fprintf(stderr, "Error reading file to find lines\n");
+    return;
+  }
+
+  if(end > section_end) end = section_end;
+  if(start >= end){
+    printf("Section has fewer than %ld lines\n", first);
+    return;
+  }
+
+  print_file_range(fb, start, end - start);
+}
+
+
+/* Output the given byte range of a label's section, counting from the start
+ * of the label line, with both ends inclusive.
+ */
+void show_fileblock_bytes(fileblock * fb, unsigned int lnum, long int first, long int last){
+  if(fb == NULL) return;
+  if(first < 0 || last < first) return;
+
+  lock_labels(fb);
+  unsigned int lcount = wait_for_labels(fb, lnum + 1);
+  if(lnum >= lcount){
+    unlock_labels(fb);
+    printf("No such label, only %u found\n", lcount);
+    return;
+  }
+
+  label * lab = get_label(fb, lnum);
+  long int section_start = lab ? lab->fpos : 0;
+  long int size = lab ? lab->stats.bytes : 0;
+  unlock_labels(fb);
+  if(lab == NULL) return;
+
+  if(first >= size){
+    printf("Section has only %ld bytes\n", size);
+    return;
+  }
+  if(last >= size) last = size - 1;
+
+  print_file_range(fb, section_start + first, last - first + 1);
+}
+
+
+/* Copy the given range of the file to stdout. Ranges up to RANGE_MAX_READ
+ * bytes take a single pread; larger ones are read in pieces of that size.
+ *
+ * Returns 0 on success.
+ */
+static int print_file_range(fileblock * fb, long int start, long int total){
+  if(total <= 0) return 0;
+
+  size_t bufsize = total < RANGE_MAX_READ ? (size_t)total : RANGE_MAX_READ;
+  char * buf = malloc(bufsize);
+  if(buf == NULL){
+    fprintf(stderr, "Error allocating buffer to read section\n");
+    return 1;
+  }
+
+  int rval = 0;
+  fflush(stdout);
+
+  while(total > 0){
+    size_t want = total < (long int)bufsize ? (size_t)total : bufsize;
+    ssize_t got = pread(fileno(fb->fhandle), buf, want, start);
+    if(got <= 0){
+      if(got < 0) perror("Error reading section");
+      rval = 1;
+      break;
+    }
+    fwrite(buf, sizeof(char), (size_t)got, stdout);
+    start += got;
+    total -= got;
+  }
+
+  free(buf);
+  return rval;
+}
+
+
+/* Labels being ordered by the qsort comparator below; qsort has no context
+ * parameter, so it is stashed here for the duration of the sort. It is per
+ * thread, as fileblocks may be indexed in parallel.
+ */
+static _Thread_local const label * sort_labels;
+
+/* Compare label texts bytewise, with shorter labels sorting first on a tie.
+ * Ties on the full text fall back to file order to keep the sort stable.
+ */
+static int compare_label_order(const void * a, const void * b){
+  unsigned int ia = *(const unsigned int *)a;
+  unsigned int ib = *(const unsigned int *)b;
+  const label * la = &sort_labels[ia];
+  const label * lb = &sort_labels[ib];
+
+  unsigned int len = la->length < lb->length ? la->length : lb->length;
+  int cmp = memcmp(la->text, lb->text, len);
+  if(cmp != 0) return cmp;
+  if(la->length != lb->length) return la->length < lb->length ? -1 : 1;
+  return ia < ib ? -1 : (ia > ib);
+}
+
+/* Sort (trigram << 32 | label index) keys which are already in label index
+ * order, by radix sorting on the trigram bytes only. Each pass is stable, so
+ * keys with equal trigrams stay in label index order. Uses the given scratch
+ * space of the same size.
+ */
+static void sort_grams(unsigned long long * grams, unsigned long long * scratch, size_t count){
+  for(int shift = 32; shift < 32 + 8 * SEARCH_GRAM_SIZE; shift += 8){
+    size_t counts[257] = {0};
+
+    for(size_t g = 0; g < count; ++g)
+      ++counts[((grams[g] >> shift) & 0xFF) + 1];
+    for(int b = 0; b < 256; ++b)
+      counts[b + 1] += counts[b];
+    for(size_t g = 0; g < count; ++g)
+      scratch[counts[(grams[g] >> shift) & 0xFF]++] = grams[g];
+
+    unsigned long long * swap = grams;
+    grams = scratch;
+    scratch = swap;
+  }
+  // An odd number of passes leaves the result in the caller's scratch space
+  if(SEARCH_GRAM_SIZE % 2) memcpy(scratch, grams, count * sizeof(unsigned long long));
+}
+
+/* Pack the SEARCH_GRAM_SIZE characters at the given position into a key.
+ */
+static unsigned long long gram_key(const char * t){
+  unsigned long long key = 0;
+  for(int j = 0; j < SEARCH_GRAM_SIZE; ++j)
+    key = (key << 8) | (unsigned char)t[j];
+  return key;
+}
+
+
+/* Build the structures used by search_fileblock_labels:
+ *  - label_order, a permutation of label indices sorted by text, so that all
+ *    labels sharing a prefix form one contiguous range
+ *  - label_grams, the sorted set of (trigram, label index) pairs, so that the
+ *    labels containing a given trigram form one contiguous range
+ *
+ * Returns 0 on success. On failure the fileblock is left without the search
+ * structures, and searching falls back to scanning every label.
+ */
+int build_label_search(fileblock * fb){
+  if(fb == NULL) return 1;
+  if(fb->label_count == 0) return 0;
+
+  // Built aside and installed under the label lock at the end, as readers may
+  // be using the labels while a background scan builds these
+  unsigned int * order;
+  unsigned long long * grams = NULL;
+  size_t kept = 0;
+
+  order = malloc(fb->label_count * sizeof(unsigned int));
+  if(order == NULL) return 2;
+
+  for(unsigned int j = 0; j < fb->label_count; ++j)
+    order[j] = j;
+
+  sort_labels = fb->labels;
+  qsort(order, fb->label_count, sizeof(unsigned int), compare_label_order);
+  sort_labels = NULL;
+
+  size_t total_grams = 0;
+  for(unsigned int j = 0; j < fb->label_count; ++j)
+    if(fb->labels[j].length >= SEARCH_GRAM_SIZE)
+      total_grams += fb->labels[j].length - SEARCH_GRAM_SIZE + 1;
+
+  if(total_grams > 0){
+    grams = malloc(total_grams * sizeof(unsigned long long));
+    unsigned long long * scratch = malloc(total_grams * sizeof(unsigned long long));
+    if(grams == NULL || scratch == NULL){
+      free(grams);
+      free(scratch);
+      free(order);
+      return 3;
+    }
+
+    size_t g = 0;
+    for(unsigned int j = 0; j < fb->label_count; ++j){
+      label * lab = &fb->labels[j];
+      for(unsigned int p = 0; p + SEARCH_GRAM_SIZE <= lab->length; ++p)
+        grams[g++] = (gram_key(lab->text + p) << 32) | j;
+    }
+
+    sort_grams(grams, scratch, total_grams);
+    free(scratch);
+
+    // Drop repeats of a trigram within the same label
+    kept = 1;
+    for(g = 1; g < total_grams; ++g)
+      if(grams[g] != grams[kept - 1])
+        grams[kept++] = grams[g];
+  }
+
+  lock_labels(fb);
+  fb->label_order = order;
+  fb->label_grams = grams;
+  fb->gram_count = kept;
+  unlock_labels(fb);
+
+  DEBUGPRINTD("Label search trigrams", (int)kept)
+
+  return 0;
+}
+
+
+/* Returns nonzero if the label text starts with the given query.
+ */
+static int label_has_prefix(const label * lab, const char * q, unsigned int qlen){
+  return lab->length >= qlen && memcmp(lab->text, q, qlen) == 0;
+}
+
+/* Returns nonzero if the label text contains the given query anywhere.
+ */
+static int label_has_substring(const label * lab, const char * q, unsigned int qlen){
+  if(qlen == 0) return 1;
+  for(unsigned int p = 0; p + qlen <= lab->length; ++p)
+    if(lab->text[p] == q[0] && memcmp(lab->text + p, q, qlen) == 0) return 1;
+  return 0;
+}
+
+/* Print a single search result in the same format as list_fileblock_labels.
+ */
+static void print_search_result(fileblock * fb, unsigned int j){
+  label * lab = get_label(fb, j);
+  if(lab == NULL) return;
+
+  char labuf[LABEL_MAX_SIZE + 1];
+
+  memcpy(labuf, lab->text, (size_t)lab->length);
+  labuf[lab->length] = '\0';
+
+  printf("%3u: %s\n", j, labuf);
+}
+
+
+/* Print the labels which start with or contain the given query text.
+ *
+ * Prefix matches are found with a binary search over label_order, and
+ * substring matches by intersecting with the smallest trigram range in
+ * label_grams, so only candidate labels are ever compared. Queries shorter
+ * than a trigram, or a fileblock without search structures (such as during a
+ * background scan), fall back to checking every label.
+ */
+void search_fileblock_labels(fileblock * fb, const char * q, unsigned int qlen){
+  if(fb == NULL || q == NULL) return;
+
+  lock_labels(fb);
+  search_labels_locked(fb, q, qlen);
+  unlock_labels(fb);
+}
+
+
+/* Body of search_fileblock_labels, run with the label lock held.
+ */
+static void search_labels_locked(fileblock * fb, const char * q, unsigned int qlen){
+  unsigned int shown = 0;
+  unsigned int found = 0;
+
+  // Prefix matches
+
+  printf("::: Labels starting with \"%s\" :::\n", q);
+
+  if(fb->label_order != NULL){
+    // Lower bound of the prefix range
+    unsigned int lo = 0, hi = fb->label_count;
+    while(lo < hi){
+      unsigned int mid = lo + (hi - lo) / 2;
+      label * lab = &fb->labels[fb->label_order[mid]];
+      unsigned int len = lab->length < qlen ? lab->length : qlen;
+      int cmp = memcmp(lab->text, q, len);
+      if(cmp < 0 || (cmp == 0 && lab->length < qlen)) lo = mid + 1;
+      else hi = mid;
+    }
+
+    for(unsigned int r = lo; r < fb->label_count; ++r){
+      unsigned int j = fb->label_order[r];
+      if(!label_has_prefix(get_label(fb, j), q, qlen)) break;
+      if(shown < SEARCH_MAX_RESULTS){
+        print_search_result(fb, j);
+        ++shown;
+      }
+      ++found;
+    }
+  } else {
+    for(unsigned int j = 0; j < fb->label_count; ++j){
+      label * lab = get_label(fb, j);
+      if(lab == NULL) return;
+      if(!label_has_prefix(lab, q, qlen)) continue;
+      if(shown < SEARCH_MAX_RESULTS){
+        print_search_result(fb, j);
+        ++shown;
+      }
+      ++found;
+    }
+  }
+
+  if(found > shown) printf("... and %u more\n", found - shown);
+  if(qlen == 0) return;
+
+  // Substring matches, not repeating the prefix matches
+
+  shown = found = 0;
+  printf("::: Other labels containing \"%s\" :::\n", q);
+
+  size_t first = 0, last = 0;
+  char use_grams = fb->label_grams != NULL && qlen >= SEARCH_GRAM_SIZE;
+
+  if(use_grams){
+    // Pick the trigram of the query with the fewest labels as candidates
+    char have_range = 0;
+    for(unsigned int p = 0; p + SEARCH_GRAM_SIZE <= qlen; ++p){
+      unsigned long long key = gram_key(q + p) << 32;
+      size_t lo = 0, hi = fb->gram_count;
+      while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(fb->label_grams[mid] < key) lo = mid + 1;
+        else hi = mid;
+      }
+      size_t start = lo;
+      hi = fb->gram_count;
+      key += 1ULL << 32;
+      while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(fb->label_grams[mid] < key) lo = mid + 1;
+        else hi = mid;
+      }
+
+      if(!have_range || lo - start < last - first){
+        first = start;
+        last = lo;
+        have_range = 1;
+      }
+      if(first == last) break;
+    }
+  }
+
+  size_t candidates = use_grams ? last - first : fb->label_count;
+
+  for(size_t c = 0; c < candidates; ++c){
+    unsigned int j = use_grams
+      ? (unsigned int)(fb->label_grams[first + c] & 0xFFFFFFFFULL)
+      : (unsigned int)c
+    ;
+    label * lab = get_label(fb, j);
+    if(lab == NULL) return;
+    if(label_has_prefix(lab, q, qlen)) continue;
+    if(!label_has_substring(lab, q, qlen)) continue;
+    if(shown < SEARCH_MAX_RESULTS){
+      print_search_result(fb, j);
+      ++shown;
+    }
+    ++found;
+  }
+
+  if(found > shown) printf("... and %u more\n", found - shown);
+}
+
+
+/* Body of the threads indexing each side of a diff.
+ */
+static void * diff_index_thread(void * arg){
+  fileblock * fb = arg;
+  intptr_t rval = init_fileblock(fb);
+  return (void *)rval;
+}
+
+
+/* Compare two labels' texts, for matching sections between files.
+ */
+static int compare_label_text(const label * a, const label * b){
+  unsigned int len = a->length < b->length ? a->length : b->length;
+  int cmp = memcmp(a->text, b->text, len);
+  if(cmp != 0) return cmp;
+  return a->length < b->length ? -1 : (a->length > b->length);
+}
+
+
+/* Print a line of the diff report for the given label.
+ */
+static void print_diff_line(const char * what, const label * lab, unsigned int from, unsigned int to){
+  char labuf[LABEL_MAX_SIZE + 1];
+  memcpy(labuf, lab->text, lab->length);
+  labuf[lab->length] = '\0';
+
+  if(from == LABEL_NONE) printf("%-8s %9s %6u: %s\n", what, "", to, labuf);
+  else if(to == LABEL_NONE) printf("%-8s %6u %9s: %s\n", what, from, "", labuf);
+  else printf("%-8s %6u -> %6u: %s\n", what, from, to, labuf);
+}
+
+
+/* Compare the sections of two files and report which were added, removed,
+ * changed or moved. The fileblocks should have their names and options set,
+ * and are initialized here, in parallel.
+ *
+ * Sections are matched by label text, with repeated labels matched in order
+ * of appearance, by merging the two files' sorted label orders. Contents are
+ * compared by the size and hash from the section stats, which were gathered
+ * while indexing, so no section is read again. Matched sections outside the
+ * longest run kept in the same relative order are reported as moved.
+ *
+ * If `show_contents` is set, the old and new text of changed sections and the
+ * text of added sections is printed as well.
+ *
+ * Returns 0 on success.
+ */
+int diff_fileblocks(fileblock * old, fileblock * new, char show_contents){
+  pthread_t threads[2];
+  fileblock * fbs[2] = {old, new};
+  int failed = 0;
+
+  for(int j = 0; j < 2; ++j)
+    if(pthread_create(&threads[j], NULL, diff_index_thread, fbs[j]) != 0){
+      fprintf(stderr, "Error starting indexing thread\n");
+      if(j == 1) pthread_join(threads[0], NULL);
+      return 1;
+    }
+
+  for(int j = 0; j < 2; ++j){
+    void * rval;
+    pthread_join(threads[j], &rval);
+    if(rval != NULL){
+      fprintf(stderr, "Error initializing %s (%d)\n", fbs[j]->fname, (int)(intptr_t)rval);
+      failed = 1;
+    }
+  }
+  if(failed) return 1;
+
+  unsigned int ocount = old->label_count;
+  unsigned int ncount = new->label_count;
+
+  if((ocount && old->label_order == NULL) || (ncount && new->label_order == NULL)){
+    fprintf(stderr, "Label order not available for diff\n");
+    return 2;
+  }
+
+  unsigned int * match_old = malloc((ocount + 1) * sizeof(unsigned int));
+  unsigned int * match_new = malloc((ncount + 1) * sizeof(unsigned int));
+  unsigned int * tails = malloc((ocount + 1) * sizeof(unsigned int));
+  unsigned int * prev = malloc((ocount + 1) * sizeof(unsigned int));
+  char * in_order = calloc(ncount + 1, sizeof(char));
+
+  if(!match_old || !match_new || !tails || !prev || !in_order){
+    fprintf(stderr, "Error allocating space for diff\n");
+    free(match_old); free(match_new); free(tails); free(prev); free(in_order);
+    return 3;
+  }
+
+  for(unsigned int j = 0; j < ocount; ++j) match_old[j] = LABEL_NONE;
+  for(unsigned int j = 0; j < ncount; ++j) match_new[j] = LABEL_NONE;
+
+  // Merge the sorted label orders; equal texts are in file order within each
+  // side, so repeated labels pair up in order of appearance
+  unsigned int oi = 0, ni = 0;
+  while(oi < ocount && ni < ncount){
+    unsigned int o = old->label_order[oi];
+    unsigned int n = new->label_order[ni];
+    int cmp = compare_label_text(&old->labels[o], &new->labels[n]);
+
+    if(cmp < 0) ++oi;
+    else if(cmp > 0) ++ni;
+    else {
+      match_old[o] = n;
+      match_new[n] = o;
+      ++oi;
+      ++ni;
+    }
+  }
+
+  // Longest increasing run of new positions, taken in old order: those
+  // sections kept their relative order, any other matched ones moved
+  unsigned int lis_len = 0;
+  for(unsigned int o = 0; o < ocount; ++o){
+    unsigned int n = match_old[o];
+    if(n == LABEL_NONE) continue;
+
+    unsigned int lo = 0, hi = lis_len;
+    while(lo < hi){
+      unsigned int mid = lo + (hi - lo) / 2;
+      if(match_old[tails[mid]] < n) lo = mid + 1;
+      else hi = mid;
+    }
+
+    prev[o] = lo > 0 ? tails[lo - 1] : LABEL_NONE;
+    tails[lo] = o;
+    if(lo == lis_len) ++lis_len;
+  }
+
+  for(unsigned int o = lis_len ? tails[lis_len - 1] : LABEL_NONE; o != LABEL_NONE; o = prev[o])
+    in_order[match_old[o]] = 1;
+
+  unsigned int removed = 0, added = 0, changed = 0, moved = 0, same = 0;
+
+  printf("::: Sections of %s -> %s :::\n", old->fname, new->fname);
+
+  for(unsigned int o = 0; o < ocount; ++o){
+    if(match_old[o] != LABEL_NONE) continue;
+    print_diff_line("removed", &old->labels[o], o, LABEL_NONE);
+    ++removed;
+  }
+
+  for(unsigned int n = 0; n < ncount; ++n){
+    label * nlab = &new->labels[n];
+    unsigned int o = match_new[n];
+
+    if(o == LABEL_NONE){
+      print_diff_line("added", nlab, LABEL_NONE, n);
+      ++added;
+      if(show_contents){
+        print_file_range(new, nlab->fpos, nlab->stats.bytes);
+        printf("\n");
+      }
+      continue;
+    }
+
+    label * olab = &old->labels[o];
+    char is_changed = olab->stats.bytes != nlab->stats.bytes
+      || olab->stats.hash != nlab->stats.hash;
+    char is_moved = !in_order[n];
+
+    if(is_changed){
+      print_diff_line(is_moved ? "chg+mov" : "changed", nlab, o, n);
+      ++changed;
+      if(is_moved) ++moved;
+      if(show_contents){
+        printf("--- old\n");
+        print_file_range(old, olab->fpos, olab->stats.bytes);
+        printf("+++ new\n");
+        print_file_range(new, nlab->fpos, nlab->stats.bytes);
+        printf("\n");
+      }
+    } else if(is_moved){
+      print_diff_line("moved", nlab, o, n);
+      ++moved;
+    } else {
+      ++same;
+    }
+  }
+
+  printf(
+    "::: %u removed, %u added, %u changed, %u moved, %u unchanged :::\n",
+    removed, added, changed, moved, same
+  );
+
+  free(match_old);
+  free(match_new);
+  free(tails);
+  free(prev);
+  free(in_order);
+
+  return 0;
+}
+
+
+/* Write out everything pending in the output buffer.
+ *
+ * Returns 0 on success.
+ */
+static int out_flush(outbuf * out){
+  size_t done = 0;
+
+  while(done < out->used && !out->failed){
+    ssize_t wrote = write(out->fd, out->buf + done, out->used - done);
+    if(wrote < 0){
+      perror("Error writing output");
+      out->failed = 1;
+    } else {
+      done += (size_t)wrote;
+    }
+  }
+
+  out->used = 0;
+  return out->failed;
+}
+
+
+/* Make room for at least the given number of bytes in the output buffer, and
+ * return where they should be written.
+ */
+static char * out_reserve(outbuf * out, size_t len){
+  if(out->used + len > OUT_BUF_SIZE) out_flush(out);
+  return out->buf + out->used;
+}
+
+
+/* Format an unsigned number in decimal at p, returning the end of it. Digits
+ * are produced two at a time from a table, back to front.
+ */
+static char * out_uint(char * p, unsigned long long val){
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char digits[20];
+  char * d = digits + sizeof(digits);
+
+  while(val >= 100){
+    unsigned int pair = (unsigned int)(val % 100) * 2;
+    val /= 100;
+    *--d = pairs[pair + 1];
+    *--d = pairs[pair];
+  }
+  if(val >= 10){
+    *--d = pairs[val * 2 + 1];
+    *--d = pairs[val * 2];
+  } else {
+    *--d = (char)('0' + val);
+  }
+
+  size_t n = (size_t)(digits + sizeof(digits) - d);
+  memcpy(p, d, n);
+  return p + n;
+}
+
+
+/* Copy a string literal to p, returning the end of it.
+ */
+#define OUT_STR(p, str) (memcpy((p), (str), sizeof(str) - 1), (p) + sizeof(str) - 1)
+
+
+/* Write label text at p as the contents of a JSON string, returning the end of
+ * it. Needs up to 6 bytes per character.
+ */
+static char * out_json_text(char * p, const char * text, unsigned int length){
+  static const char hex[] = "0123456789abcdef";
+
+  for(unsigned int j = 0; j < length; ++j){
+    unsigned char c = (unsigned char)text[j];
+    if(c == '"' || c == '\\'){
+      *p++ = '\\';
+      *p++ = (char)c;
+    } else if(c < 0x20){
+      p = OUT_STR(p, "\\u00");
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else {
+      *p++ = (char)c;
+    }
+  }
+
+  return p;
+}
+
+
+/* Write label text at p as a TSV field, escaping tabs, line breaks and
+ * backslashes, returning the end of it. Needs up to 2 bytes per character.
+ */
+static char * out_tsv_text(char * p, const char * text, unsigned int length){
+  for(unsigned int j = 0; j < length; ++j){
+    char c = text[j];
+    switch(c){
+    case '\t': *p++ = '\\'; *p++ = 't'; break;
+    case '\n': *p++ = '\\'; *p++ = 'n'; break;
+    case '\r': *p++ = '\\'; *p++ = 'r'; break;
+    case '\\': *p++ = '\\'; *p++ = '\\'; break;
+    default: *p++ = c;
+    }
+  }
+
+  return p;
+}
+
+
+/* Format one label as a record of the given format at p, returning the end of
+ * it. Text records take at most OUT_MAX_RECORD bytes.
+ */
+static char * format_label_record(char * p, int format, label * lab, unsigned int lnum){
+  if(format == EXPORT_BINARY){
+    label_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.fpos = (uint64_t)lab->fpos;
+    rec.bytes = (uint64_t)lab->stats.bytes;
+    rec.index = lnum;
+    rec.parent = lab->parent;
+    rec.level = (uint8_t)lab->level;
+    rec.length = (uint8_t)lab->length;
+    memcpy(rec.text, lab->text, (size_t)lab->length);
+
+    memcpy(p, &rec, sizeof(rec));
+    return p + sizeof(rec);
+  }
+
+  if(format == EXPORT_TSV){
+    p = out_uint(p, lnum);
+    *p++ = '\t';
+    p = out_uint(p, (unsigned long long)lab->fpos);
+    *p++ = '\t';
+    p = out_uint(p, lab->level);
+    *p++ = '\t';
+    if(lab->parent != LABEL_NONE) p = out_uint(p, lab->parent);
+    *p++ = '\t';
+    p = out_uint(p, lab->length);
+    *p++ = '\t';
+    p = out_uint(p, (unsigned long long)lab->stats.bytes);
+    *p++ = '\t';
+    p = out_tsv_text(p, lab->text, lab->length);
+    *p++ = '\n';
+    return p;
+  }
+
+  p = OUT_STR(p, "{\"index\":");
+  p = out_uint(p, lnum);
+  p = OUT_STR(p, ",\"fpos\":");
+  p = out_uint(p, (unsigned long long)lab->fpos);
+  p = OUT_STR(p, ",\"level\":");
+  p = out_uint(p, lab->level);
+  p = OUT_STR(p, ",\"parent\":");
+  if(lab->parent != LABEL_NONE) p = out_uint(p, lab->parent);
+  else p = OUT_STR(p, "null");
+  p = OUT_STR(p, ",\"length\":");
+  p = out_uint(p, lab->length);
+  p = OUT_STR(p, ",\"bytes\":");
+  p = out_uint(p, (unsigned long long)lab->stats.bytes);
+  p = OUT_STR(p, ",\"text\":\"");
+  p = out_json_text(p, lab->text, lab->length);
+  p = OUT_STR(p, "\"}\n");
+  return p;
+}
+
+
+/* Write the label table to the given descriptor in one of the EXPORT_ formats:
+ * NDJSON objects, TSV rows under a header row, or a label_record_header
+ * followed by fixed-width label_record structs. Records are formatted straight
+ * into one large buffer, bypassing stdio, which is written out as it fills.
+ *
+ * Returns 0 on success.
+ */
+int export_fileblock_labels(fileblock * fb, int format, int fd){
+  if(fb == NULL) return 1;
+
+  outbuf out = { .fd = fd };
+  out.buf = malloc(OUT_BUF_SIZE);
+  if(out.buf == NULL){
+    fprintf(stderr, "Error allocating output buffer\n");
+    return 1;
+  }
+
+  // Anything already printed through stdio must come first
+  fflush(stdout);
+
+  if(format == EXPORT_BINARY){
+    label_record_header head;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, LABEL_RECORD_MAGIC, sizeof(head.magic));
+    head.record_size = sizeof(label_record);
+    head.count = fb->label_count;
+
+    memcpy(out_reserve(&out, sizeof(head)), &head, sizeof(head));
+    out.used += sizeof(head);
+  } else if(format == EXPORT_TSV){
+    char * p = out_reserve(&out, OUT_MAX_RECORD);
+    out.used = (size_t)(OUT_STR(p, "index\tfpos\tlevel\tparent\tlength\tbytes\ttext\n") - out.buf);
+  }
+
+  for(unsigned int j = 0; j < fb->label_count && !out.failed; ++j){
+    label * lab = get_label(fb, j);
+    if(lab == NULL){
+      out.failed = 1;
+      break;
+    }
+
+    char * p = out_reserve(&out, OUT_MAX_RECORD);
+    out.used = (size_t)(format_label_record(p, format, lab, j) - out.buf);
+  }
+
+  out_flush(&out);
+  free(out.buf);
+
+  return out.failed;
+}
+
+
+/* A rewrite of the file in which the byte range [start, end) is replaced by
+ * head, then content_len bytes of content_fd (if not negative), then tail.
+ */
+typedef struct {
+  long int       start;       // First byte of the old file being replaced
+  long int       end;         // One past the last byte being replaced
+  const char   * head;        // Bytes written first
+  size_t         head_len;
+  int            content_fd;  // File holding the new contents, or -1
+  long int       content_len; // Bytes of content_fd to write
+  const char   * tail;        // Bytes written last
+  size_t         tail_len;
+  long int       new_lines;   // Newlines in everything written
+} file_edit;
+
+/* State shared with the parser callbacks while checking new section text.
+ */
+typedef struct {
+  unsigned int   labels;      // Number of labels found
+  unsigned int   level;       // Level of the last label found
+  unsigned int   length;      // Length of the last label's text
+  char           text[LABEL_MAX_SIZE]; // Text of the last label
+} edit_check_ctx;
+
+
+static void edit_check_label_start(void * ctx, long int fpos, long int delim_pos, unsigned int level){
+  edit_check_ctx * ec = ctx;
+  ++ec->labels;
+  ec->level = level;
+  ec->length = 0;
+}
+
+static void edit_check_label_end(void * ctx, long int fpos, const char * text, unsigned int length){
+  edit_check_ctx * ec = ctx;
+  memcpy(ec->text, text, length);
+  ec->length = length;
+}
+
+
+/* Write all of the given bytes to a descriptor.
+ *
+ * Returns 0 on success.
+ */
+static int write_all(int fd, const char * buf, size_t len){
+  while(len > 0){
+    ssize_t wrote = write(fd, buf, len);
+    if(wrote < 0){
+      perror("Error writing file");
+      return 1;
+    }
+    buf += wrote;
+    len -= (size_t)wrote;
+  }
+  return 0;
+}
+
+
+/* Append a range of one file to another at its current position. The copy is
+ * done in the kernel with copy_file_range where the filesystems allow it, and
+ * with pread and write otherwise.
+ *
+ * Returns 0 on success.
+ */
+static int copy_range(int in, long int start, long int len, int out){
+  loff_t off = start;
+
+  while(len > 0){
+    ssize_t done = copy_file_range(in, &off, out, NULL, (size_t)len, 0);
+    if(done < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      break;
+    if(done <= 0){
+      if(done < 0) perror("Error copying file range");
+      return 1;
+    }
+    len -= done;
+  }
+
+  char buf[SCAN_BUF_SIZE];
+
+  while(len > 0){
+    size_t want = len < (long int)sizeof(buf) ? (size_t)len : sizeof(buf);
+    ssize_t got = pread(in, buf, want, off);
+    if(got <= 0){
+      if(got < 0) perror("Error reading file");
+      return 1;
+    }
+    if(write_all(out, buf, (size_t)got)) return 1;
+    off += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+
+/* Add bytes to the stats of an edited section, newlines included.
+ */
+static void accumulate_edit_stats(section_accum * acc, const char * buf, size_t len){
+  accumulate_section_stats(acc, buf, len);
+  acc->cur.lines += count_newlines(buf, len);
+}
+
+
+/* Feed a range of a file to the section stats and, if given, to a parser
+ * checking it for delimiter lines.
+ *
+ * Returns 0 on success.
+ */
+static int scan_edit_range(int fd, long int start, long int len, section_accum * acc, sm_parser * parser){
+  char buf[SCAN_BUF_SIZE];
+
+  while(len > 0){
+    size_t want = len < (long int)sizeof(buf) ? (size_t)len : sizeof(buf);
+    ssize_t got = pread(fd, buf, want, start);
+    if(got <= 0){
+      if(got < 0) perror("Error reading file");
+      return 1;
+    }
+    accumulate_edit_stats(acc, buf, (size_t)got);
+    if(parser != NULL) sm_parser_feed(parser, buf, (size_t)got);
+    start += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+
+/* Open a file of new section contents and find its size, and whether it needs
+ * a newline added to keep the following delimiter at the start of a line.
+ *
+ * Returns the descriptor, or -1 on error. An empty path gives no contents.
+ */
+static int open_edit_content(const char * path, file_edit * ed){
+  struct stat st;
+
+  ed->content_fd = -1;
+  ed->content_len = 0;
+  ed->tail = "";
+  ed->tail_len = 0;
+
+  if(path == NULL || path[0] == '\0') return 0;
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) != 0){
+    perror("Error opening contents file");
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+
+  ed->content_fd = fd;
+  ed->content_len = (long int)st.st_size;
+
+  char last = '\n';
+  if(ed->content_len > 0 && pread(fd, &last, 1, ed->content_len - 1) != 1){
+    perror("Error reading contents file");
+    close(fd);
+    ed->content_fd = -1;
+    return -1;
+  }
+  if(last != '\n'){
+    ed->tail = "\n";
+    ed->tail_len = 1;
+  }
+
+  return fd;
+}
+
+
+/* Write the edited file to a temporary file next to it, then rename it over
+ * the original, so that the file is replaced atomically. Unchanged ranges are
+ * copied with copy_range. The temporary file is opened for reading before the
+ * rename and becomes the fileblock's handle, so once the file is replaced
+ * nothing is left that can fail.
+ *
+ * Returns 0 on success, leaving the original untouched on failure.
+ */
+static int rewrite_fileblock_file(fileblock * fb, const file_edit * ed){
+  int fd = fileno(fb->fhandle);
+  struct stat st;
+
+  if(fstat(fd, &st) != 0){
+    perror("Error inspecting file");
+    return 1;
+  }
+
+  size_t name_len = strlen(fb->fname);
+  char * tmpname = malloc(name_len + 8);
+  if(tmpname == NULL){
+    fprintf(stderr, "Error allocating temporary file name\n");
+    return 1;
+  }
+  memcpy(tmpname, fb->fname, name_len);
+  memcpy(tmpname + name_len, ".XXXXXX", 8);
+
+  int tfd = mkstemp(tmpname);
+  if(tfd < 0){
+    perror("Error creating temporary file");
+    free(tmpname);
+    return 1;
+  }
+
+  int rval = fchmod(tfd, st.st_mode & 07777) != 0
+    || copy_range(fd, 0, ed->start, tfd)
+    || write_all(tfd, ed->head, ed->head_len)
+    || (ed->content_fd >= 0 && copy_range(ed->content_fd, 0, ed->content_len, tfd))
+    || write_all(tfd, ed->tail, ed->tail_len)
+    || copy_range(fd, ed->end, fb->fsize - ed->end, tfd)
+    || fsync(tfd) != 0;
+
+  if(close(tfd) != 0) rval = 1;
+
+  FILE * f = NULL;
+  if(!rval && (f = fopen(tmpname, "r")) == NULL){
+    perror("Error opening new file");
+    rval = 1;
+  }
+
+  if(rval || rename(tmpname, fb->fname) != 0){
+    if(!rval) perror("Error replacing file");
+    if(f != NULL) fclose(f);
+    unlink(tmpname);
+    free(tmpname);
+    return 1;
+  }
+  free(tmpname);
+
+  fclose(fb->fhandle);
+  fb->fhandle = f;
+
+  return 0;
+}
+
+
+/* Bring everything indexed after an edit up to date without rescanning: the
+ * positions of the labels after the edit and the line index samples are
+ * shifted by the change in size and line count, and samples that pointed
+ * into the replaced range are dropped. The whole-file buffer, if in use, is
+ * read again. Called after the labels themselves have been patched, with
+ * first_after the index of the first label following the edit.
+ */
+static void patch_fileblock_positions(fileblock * fb, const file_edit * ed, long int old_lines, unsigned int first_after){
+  long int new_len = (long int)(ed->head_len + ed->tail_len) + ed->content_len;
+  long int delta = new_len - (ed->end - ed->start);
+  long int line_delta = ed->new_lines - old_lines;
+
+  for(unsigned int j = first_after; j < fb->label_count; ++j)
+    fb->labels[j].fpos += delta;
+
+  size_t kept = 0;
+  for(size_t j = 0; j < fb->line_sample_count; ++j){
+    line_sample ls = fb->line_samples[j];
+    if(ls.fpos > ed->start && ls.fpos < ed->end) continue;
+    if(ls.fpos >= ed->end && ls.fpos > ed->start){
+      ls.fpos += delta;
+      ls.line = (unsigned long)((long int)ls.line + line_delta);
+    }
+    fb->line_samples[kept++] = ls;
+  }
+  fb->line_sample_count = kept;
+
+  fb->fsize += delta;
+
+  if(fb->buf != NULL){
+    free(fb->buf);
+    fb->buf = NULL;
+    if(load_fileblock_file_maybe(fb))
+      fprintf(stderr, "Error reloading file buffer, reading from file instead\n");
+  }
+}
+
+
+/* Wait for a background scan to finish, as edits need the full label table.
+ * Returns nonzero if the scan was given up, leaving the table incomplete.
+ */
+static int wait_for_scan(fileblock * fb){
+  if(!(fb->operations & FB_SCANNER)) return 0;
+
+  pthread_mutex_lock(&fb->lock);
+  while(fb->scanning)
+    pthread_cond_wait(&fb->found, &fb->lock);
+  char stopped = fb->stop_scan;
+  pthread_mutex_unlock(&fb->lock);
+
+  return stopped;
+}
+
+
+/* Returns the offset of the start of the line holding the byte before pos,
+ * reading backwards through the file; that is, the start of the line that
+ * pos ends, or -1 on error.
+ */
+static long int find_line_start(fileblock * fb, long int pos){
+  char buf[SCAN_BUF_SIZE / 16];
+
+  --pos;
+  while(pos > 0){
+    long int from = pos > (long int)sizeof(buf) ? pos - (long int)sizeof(buf) : 0;
+    ssize_t got = pread(fileno(fb->fhandle), buf, (size_t)(pos - from), from);
+    if(got != pos - from) return -1;
+
+    for(long int j = got; j > 0; --j)
+      if(buf[j - 1] == '\n') return from + j;
+    pos = from;
+  }
+
+  return 0;
+}
+
+
+/* Returns the offset where the delimiter line of the given label starts.
+ */
+static long int label_delim_pos(fileblock * fb, unsigned int lnum){
+  long int fpos = fb->labels[lnum].fpos;
+  char before;
+
+  if(pread(fileno(fb->fhandle), &before, 1, fpos - 1) != 1) return -1;
+
+  // The label is either on the line after the delimiter, or after the
+  // delimiters on the same line
+  return find_line_start(fb, before == '\n' ? fpos - 1 : fpos);
+}
+
+
+/* Patch the search structures for labels [first, first + count) having been
+ * removed, renumbering the labels after them. Called once label_count no
+ * longer includes the removed labels.
+ */
+static void remove_from_search(fileblock * fb, unsigned int first, unsigned int count){
+  if(fb->label_order != NULL){
+    unsigned int kept = 0;
+    for(unsigned int j = 0; j < fb->label_count + count; ++j){
+      unsigned int o = fb->label_order[j];
+      if(o >= first && o < first + count) continue;
+      fb->label_order[kept++] = o >= first + count ? o - count : o;
+    }
+  }
+
+  size_t kept = 0;
+  for(size_t g = 0; g < fb->gram_count; ++g){
+    unsigned int o = (unsigned int)fb->label_grams[g];
+    if(o >= first && o < first + count) continue;
+    fb->label_grams[kept++] = o >= first + count ? fb->label_grams[g] - count : fb->label_grams[g];
+  }
+  fb->gram_count = kept;
+}
+
+
+/* Patch the search structures for a label having been inserted at the given
+ * index, renumbering the labels after it. Renumbering keeps both structures
+ * sorted, so the new label's entries are merged in at their sorted places.
+ *
+ * Returns 0 on success. On failure the search structures are dropped, and
+ * searching falls back to scanning every label.
+ */
+static int insert_into_search(fileblock * fb, unsigned int lnum){
+  label * lab = &fb->labels[lnum];
+  unsigned int old_count = fb->label_count - 1;
+
+  if(fb->label_order != NULL){
+    unsigned int * order = realloc(fb->label_order, fb->label_count * sizeof(unsigned int));
+    if(order == NULL) goto fail;
+    fb->label_order = order;
+
+    unsigned int at = old_count;
+    for(unsigned int j = 0; j < old_count; ++j){
+      if(order[j] >= lnum) ++order[j];
+      if(at == old_count){
+        int cmp = compare_label_text(&fb->labels[order[j]], lab);
+        if(cmp > 0 || (cmp == 0 && order[j] > lnum)) at = j;
+      }
+    }
+
+    memmove(order + at + 1, order + at, (old_count - at) * sizeof(unsigned int));
+    order[at] = lnum;
+  }
+
+  for(size_t g = 0; g < fb->gram_count; ++g)
+    if((unsigned int)fb->label_grams[g] >= lnum) ++fb->label_grams[g];
+
+  if(fb->label_grams != NULL && lab->length >= SEARCH_GRAM_SIZE){
+    unsigned long long keys[LABEL_MAX_SIZE];
+    unsigned int nkeys = 0;
+
+    // Insertion sort the few new keys, dropping repeats
+    for(unsigned int p = 0; p + SEARCH_GRAM_SIZE <= lab->length; ++p){
+      unsigned long long key = (gram_key(lab->text + p) << 32) | lnum;
+      unsigned int k = nkeys;
+      while(k > 0 && keys[k - 1] > key) --k;
+      if(k > 0 && keys[k - 1] == key) continue;
+      memmove(keys + k + 1, keys + k, (nkeys - k) * sizeof(keys[0]));
+      keys[k] = key;
+      ++nkeys;
+    }
+
+    unsigned long long * grams = realloc(fb->label_grams, (fb->gram_count + nkeys) * sizeof(unsigned long long));
+    if(grams == NULL) goto fail;
+    fb->label_grams = grams;
+
+    // Merge from the back
+    size_t g = fb->gram_count;
+    size_t out = fb->gram_count + nkeys;
+    fb->gram_count = out;
+    while(nkeys > 0){
+      if(g > 0 && grams[g - 1] > keys[nkeys - 1]) grams[--out] = grams[--g];
+      else grams[--out] = keys[--nkeys];
+    }
+  }
+
+  return 0;
+
+fail:
+  free(fb->label_order);
+  fb->label_order = NULL;
+  free(fb->label_grams);
+  fb->label_grams = NULL;
+  fb->gram_count = 0;
+  return 1;
+}
+
+
+/* Replace the contents of a label's section, keeping its label line, with the
+ * contents of the given file (or nothing, for an empty path). Nested sections
+ * are kept. The new contents may not contain delimiter lines.
+ *
+ * Returns 0 on success.
+ */
+int replace_fileblock_section(fileblock * fb, unsigned int lnum, const char * path){
+  if(fb == NULL) return 1;
+  if(wait_for_scan(fb)) return 2;
+  if(lnum >= fb->label_count){
+    printf("No such label, only %u found\n", fb->label_count);
+    return 3;
+  }
+
+  label * lab = &fb->labels[lnum];
+  int fd = fileno(fb->fhandle);
+  long int section_end = lab->fpos + lab->stats.bytes;
+
+  // The contents start after the label line, which might end the file
+  long int body = lab->fpos;
+  char c = 0;
+  while(body < section_end && pread(fd, &c, 1, body) == 1){
+    ++body;
+    if(c == '\n') break;
+  }
+
+  file_edit ed = {
+    .start = body,
+    .end = section_end,
+    .head = c == '\n' ? "" : "\n",
+    .head_len = c == '\n' ? 0 : 1,
+  };
+
+  if(open_edit_content(path, &ed) < 0) return 4;
+
+  // Work out the new section's stats, checking for delimiter lines on the way
+  edit_check_ctx ec = {0};
+  sm_callbacks cb = {
+    .label_start = edit_check_label_start,
+    .label_end = edit_check_label_end,
+    .ctx = &ec,
+  };
+  sm_parser parser;
+  sm_parser_init(&parser, fb->table, &cb);
+
+  section_accum acc;
+  reset_section_accum(&acc);
+
+  int rval = scan_edit_range(fd, lab->fpos, body - lab->fpos, &acc, NULL);
+  unsigned int label_lines = acc.cur.lines;
+  accumulate_edit_stats(&acc, ed.head, ed.head_len);
+  if(!rval) rval = scan_edit_range(ed.content_fd, 0, ed.content_len, &acc, &parser);
+  accumulate_edit_stats(&acc, ed.tail, ed.tail_len);
+  sm_parser_feed(&parser, ed.tail, ed.tail_len);
+  ed.new_lines = (long int)(acc.cur.lines - label_lines);
+
+  if(!rval && ec.labels){
+    printf("New contents contain a delimiter line, not replacing\n");
+    rval = 5;
+  }
+
+  long int old_lines = rval ? 0 : line_of_offset(fb, ed.end) - line_of_offset(fb, ed.start);
+  if(!rval && rewrite_fileblock_file(fb, &ed)) rval = 6;
+  if(ed.content_fd >= 0) close(ed.content_fd);
+  if(rval) return rval;
+
+  lab->stats = section_accum_stats(&acc);
+  patch_fileblock_positions(fb, &ed, old_lines, lnum + 1);
+
+  return 0;
+}
+
+
+/* Insert a new section with the given label and the contents of the given
+ * file (or nothing, for an empty path) after the given label and everything
+ * nested in it, at the same nesting level.
+ *
+ * Returns 0 on success.
+ */
+int insert_fileblock_section(fileblock * fb, unsigned int lnum, const char * text, const char * path){
+  if(fb == NULL || text == NULL) return 1;
+  if(wait_for_scan(fb)) return 2;
+  if(lnum >= fb->label_count){
+    printf("No such label, only %u found\n", fb->label_count);
+    return 3;
+  }
+
+  unsigned int length = (unsigned int)strlen(text);
+  if(length == 0 || length > LABEL_MAX_SIZE){
+    printf("Label must be 1 - %d characters\n", LABEL_MAX_SIZE);
+    return 3;
+  }
+  if(!label_passes_filters(fb, text, length)){
+    printf("Label does not match the label filters\n");
+    return 3;
+  }
+
+  unsigned int level = fb->labels[lnum].level;
+  unsigned int at = fb->labels[lnum].subtree_end;
+  long int pos = subtree_end_pos(fb, lnum);
+  int fd = fileno(fb->fhandle);
+
+  // The delimiter must start a line, which the end of the file might not
+  char before = '\n';
+  if(pos > 0 && pread(fd, &before, 1, pos - 1) != 1){
+    perror("Error reading file");
+    return 4;
+  }
+
+  // Newline, delimiter line, then label line
+  char head[1 + SM_MAX_RUN + 1 + LABEL_MAX_SIZE + 1];
+  size_t lead = before == '\n' ? 0 : 1;
+  size_t head_len = 0;
+
+  if(lead) head[head_len++] = '\n';
+  memset(head + head_len, fb->table->delims[level], fb->table->min_run);
+  head_len += fb->table->min_run;
+  head[head_len++] = '\n';
+  size_t label_line = head_len;
+  memcpy(head + head_len, text, length);
+  head_len += length;
+  head[head_len++] = '\n';
+
+  file_edit ed = {
+    .start = pos,
+    .end = pos,
+    .head = head,
+    .head_len = head_len,
+  };
+
+  if(open_edit_content(path, &ed) < 0) return 4;
+
+  edit_check_ctx ec = {0};
+  sm_callbacks cb = {
+    .label_start = edit_check_label_start,
+    .label_end = edit_check_label_end,
+    .ctx = &ec,
+  };
+  sm_parser parser;
+  sm_parser_init(&parser, fb->table, &cb);
+  sm_parser_feed(&parser, head, head_len);
+
+  int rval = 0;
+  if(ec.labels != 1 || ec.level != level || ec.length != length || memcmp(ec.text, text, length) != 0){
+    printf("Label has characters outside the label character class\n");
+    rval = 5;
+  }
+
+  section_accum acc;
+  reset_section_accum(&acc);
+  accumulate_edit_stats(&acc, head + label_line, head_len - label_line);
+  if(!rval) rval = scan_edit_range(ed.content_fd, 0, ed.content_len, &acc, &parser);
+  accumulate_edit_stats(&acc, ed.tail, ed.tail_len);
+  sm_parser_feed(&parser, ed.tail, ed.tail_len);
+  ed.new_lines = (long int)(acc.cur.lines + lead + 1);
+
+  if(!rval && ec.labels > 1){
+    printf("New contents contain a delimiter line, not inserting\n");
+    rval = 5;
+  }
+
+  if(!rval){
+    lock_labels(fb);
+    if(reserve_label_space(fb, fb->label_count + 1, fb->texts_used + length)){
+      fprintf(stderr, "Error allocating space for labels\n");
+      rval = 6;
+    }
+    unlock_labels(fb);
+  }
+
+  if(!rval && rewrite_fileblock_file(fb, &ed)) rval = 6;
+  if(ed.content_fd >= 0) close(ed.content_fd);
+  if(rval) return rval;
+
+  // A newline added to end the file belongs to the section it ends, whose
+  // hash has to be worked out again
+  if(lead && at > 0){
+    label * last = &fb->labels[at - 1];
+    if(last->fpos + last->stats.bytes == pos){
+      section_accum prev;
+      reset_section_accum(&prev);
+      if(scan_edit_range(fileno(fb->fhandle), last->fpos, pos + 1 - last->fpos, &prev, NULL))
+        fprintf(stderr, "Error reading file to update section stats\n");
+      else
+        last->stats = section_accum_stats(&prev);
+    }
+  }
+
+  // Make room, and renumber the tree around the new label
+  memmove(&fb->labels[at + 1], &fb->labels[at], (fb->label_count - at) * sizeof(label));
+  ++fb->label_count;
+
+  for(unsigned int j = 0; j < at; ++j){
+    label * l = &fb->labels[j];
+    if(l->subtree_end >= at && l->level < level) ++l->subtree_end;
+  }
+  for(unsigned int j = at + 1; j < fb->label_count; ++j){
+    label * l = &fb->labels[j];
+    ++l->subtree_end;
+    if(l->parent != LABEL_NONE && l->parent >= at) ++l->parent;
+  }
+
+  label * lab = &fb->labels[at];
+  lab->text = fb->label_texts + fb->texts_used;
+  memcpy(lab->text, text, length);
+  fb->texts_used += length;
+  lab->length = length;
+  lab->fpos = pos + (long int)label_line;
+  lab->stats = section_accum_stats(&acc);
+  lab->level = level;
+  lab->parent = fb->labels[lnum].parent;
+  lab->subtree_end = at + 1;
+
+  if(insert_into_search(fb, at))
+    fprintf(stderr, "Error updating label search index, searching will be slow\n");
+
+  patch_fileblock_positions(fb, &ed, 0, at + 1);
+
+  return 0;
+}
+
+
+/* Delete a label's section, including its delimiter line and everything
+ * nested in it.
+ *
+ * Returns 0 on success.
+ */
+int delete_fileblock_section(fileblock * fb, unsigned int lnum){
+  if(fb == NULL) return 1;
+  if(wait_for_scan(fb)) return 2;
+  if(lnum >= fb->label_count){
+    printf("No such label, only %u found\n", fb->label_count);
+    return 3;
+  }
+
+  unsigned int end = fb->labels[lnum].subtree_end;
+  unsigned int count = end - lnum;
+
+  file_edit ed = {
+    .start = label_delim_pos(fb, lnum),
+    .end = subtree_end_pos(fb, lnum),
+    .head = "",
+    .content_fd = -1,
+    .tail = "",
+  };
+
+  if(ed.start < 0){
+    fprintf(stderr, "Error reading file to find delimiter\n");
+    return 4;
+  }
+
+  long int old_lines = line_of_offset(fb, ed.end) - line_of_offset(fb, ed.start);
+  if(rewrite_fileblock_file(fb, &ed)) return 6;
+
+  for(unsigned int j = 0; j < lnum; ++j)
+    if(fb->labels[j].subtree_end >= end) fb->labels[j].subtree_end -= count;
+
+  memmove(&fb->labels[lnum], &fb->labels[end], (fb->label_count - end) * sizeof(label));
+  fb->label_count -= count;
+
+  for(unsigned int j = lnum; j < fb->label_count; ++j){
+    label * l = &fb->labels[j];
+    l->subtree_end -= count;
+    if(l->parent != LABEL_NONE && l->parent >= end) l->parent -= count;
+  }
+
+  // The text of the removed labels is left unused in label_texts
+  remove_from_search(fb, lnum, count);
+  patch_fileblock_positions(fb, &ed, old_lines, lnum);
+
+  return 0;
+}
+
+
+/* Print out the size of the given file (or so).
+ * Returns a negative value on error.
+ */
+long int get_file_size(FILE * f){
+  if(f == NULL) return -1L;
+
+  struct stat st;
+
+  if(fstat(fileno(f), &st) != 0){
+    perror("Error occurred while getting file status");
+    return -1L;
+  }
+
+  return (long int)st.st_size;
+}
+
+
+/* Dump out the contents of the given file.
+ */
+int dump_file_contents(FILE * f){
+  if(f == NULL) return 1;
 
   rewind(f);
 
@@ -643,10 +3863,18 @@ void test_dump_fileblock(fileblock * fb){
   printf("Opened fileblock for: %s\n", fb->fname);
   printf("Size: %ld\n", fb->fsize);
 
+  // In lazy mode this waits for the whole scan
+  lock_labels(fb);
+  wait_for_labels(fb, UINT_MAX);
+  unlock_labels(fb);
+
   printf("Found %u labels:\n", fb->label_count);
   for(int j = 0; j < fb->label_count; ++j){
-    printf("Label %2d: [%5ld] (%2u) ", j, fb->labels[j].fpos, fb->labels[j].length);
-    fwrite(fb->labels[j].text, sizeof(char), fb->labels[j].length, stdout);
+    label * lab = get_label(fb, j);
+    if(lab == NULL) break;
+
+    printf("Label %2d: [%5ld] (%2u) ", j, lab->fpos, lab->length);
+    fwrite(lab->text, sizeof(char), lab->length, stdout);
     printf("\n");
   }
 
@@ -714,3 +3942,83 @@ int get_user_number(int min, int max, int * fail_count){
   return input;
 }
 
+
+/* Ask the user to pick a label by number. During a background scan, numbers
+ * past the labels found so far are allowed, as they may yet be found.
+ *
+ * Returns the chosen label, -1 if there are no labels, or -2 on input error.
+ */
+static int select_label(fileblock * fb){
+  unsigned int lcount;
+  char scanning;
+  int input;
+
+  lock_labels(fb);
+  lcount = wait_for_labels(fb, 1);
+  scanning = fb->scanning;
+  unlock_labels(fb);
+
+  if(lcount < 1){
+    printf("No labels found, sorry\n");
+    return -1;
+  }
+
+  if(scanning){
+    printf("Select label (at least %u so far). ", lcount);
+    input = get_user_number(0, INT_MAX - 1, NULL);
+  } else {
+    printf("Select label. ");
+    input = get_user_number(0, lcount - 1, NULL);
+  }
+
+  return input < 0 ? -2 : input;
+}
+
+
+/* Read a range of two numbers from the user, as "first-last" or "first last".
+ * Neither may be more than RANGE_MAX_VALUE.
+ *
+ * Returns 0 on success, 1 if the input is not a valid range, or -1 on error.
+ */
+static int get_user_range(long int * first, long int * last){
+  char buf[64];
+
+  if(get_user_string(buf, sizeof(buf)) < 0) return -1;
+
+  if(sscanf(buf, "%ld - %ld", first, last) == 2
+  || sscanf(buf, "%ld %ld", first, last) == 2
+  ){
+    return *first < 0 || *last < *first || *last > RANGE_MAX_VALUE;
+  }
+
+  return 1;
+}
+
+
+/* Read a line of user input from stdin into the given buffer, without the
+ * trailing newline. Anything past the buffer size is discarded.
+ *
+ * Returns the length of the stored string, or -1 on error.
+ */
+int get_user_string(char * buf, int size){
+  if(buf == NULL || size < 2) return -1;
+
+  clearerr(stdin);
+  if(fgets(buf, size, stdin) == NULL){
+    if(ferror(stdin)) perror("Error reading input");
+    return -1;
+  }
+
+  int len = (int)strlen(buf);
+
+  if(len > 0 && buf[len - 1] == '\n'){
+    buf[--len] = '\0';
+  } else {
+    int c;
+    do c = fgetc(stdin);
+    while(c != EOF && c != '\n');
+  }
+
+  return len;
+}
+
@@ -2,9 +2,9 @@
 #define DEBUG 1
 
 #if DEBUG > 0
-  #define DEBUGPRINT(t) printf("DEBUG: %s\n", t);
-  #define DEBUGPRINTC(t, c) printf("DEBUG: %s: %c\n", t, c);
-  #define DEBUGPRINTD(t, d) printf("DEBUG: %s: %d\n", t, d);
+  #define DEBUGPRINT(t) fprintf(stderr, "DEBUG: %s\n", t);
+  #define DEBUGPRINTC(t, c) fprintf(stderr, "DEBUG: %s: %c\n", t, c);
+  #define DEBUGPRINTD(t, d) fprintf(stderr, "DEBUG: %s: %d\n", t, d);
 #else
   #define DEBUGPRINT(t) ;
   #define DEBUGPRINTC(t, c) ;
@@ -12,9 +12,9 @@
 #endif
 
 #if DEBUG > 1
-  #define DEBUGPRINT_V(t) printf("DEBUG: %s\n", t);
-  #define DEBUGPRINTC_V(t, c) printf("DEBUG: %s: %c\n", t, c);
-  #define DEBUGPRINTD_V(t, d) printf("DEBUG: %s: %d\n", t, d);
+  #define DEBUGPRINT_V(t) fprintf(stderr, "DEBUG: %s\n", t);
+  #define DEBUGPRINTC_V(t, c) fprintf(stderr, "DEBUG: %s: %c\n", t, c);
+  #define DEBUGPRINTD_V(t, d) fprintf(stderr, "DEBUG: %s: %d\n", t, d);
 #else
   #define DEBUGPRINT_V(t) ;
   #define DEBUGPRINTC_V(t, c) ;
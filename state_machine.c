@@ -3,15 +3,81 @@
  * This is a state machine to parse a block of text and search for labels.
  * Labels consist of a line of text which has a preceeding line that begins with
  * 5 equals signs (=). The preceeding line is not a part of the label.
+ *
+ * The state machine can be stepped directly with run_iteration. The test main
+ * checks that the table-driven parser below finds the same labels.
+ *
+ * For scanning files, the same rule can be generalized into an sm_grammar
+ * (delimiter bytes, minimum run length, label character class, and whether a
+ * label may follow the delimiter on the same line), which is compiled into
+ * an sm_table of state transitions. A grammar may have several delimiter
+ * bytes, one per level of nesting, such as '=' for chapters and '-' for the
+ * subsections within them. An sm_parser runs such a table over input
+ * fed in arbitrary chunks and reports labels with their absolute offsets
+ * through callbacks.
  */
 
 #include "macros.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#define SM_LABEL_MAX_SIZE 64
+#define SM_MAX_RUN 64
+#define SM_MAX_LEVELS 3
+#define SM_MAX_STATES (SM_MAX_LEVELS * SM_MAX_RUN + 3)
+
+// States of a compiled table. Each level has the run states for 1 up to
+// min_run delimiter bytes, the last of which means the run matched and the
+// rest of the delimiter line follows; the ignore and label states come after.
+#define SM_LINE 0                                         // Start of a line
+#define SM_RUN(t, l, n) ((l) * (t)->min_run + (n))        // n bytes of level l
+#define SM_DELIM(t, l) SM_RUN(t, l, (t)->min_run)         // Run of level l matched
+#define SM_IGNORE(t) ((t)->levels * (t)->min_run + 1)     // Rest of a plain line
+#define SM_LABEL(t) ((t)->levels * (t)->min_run + 2)      // In a label line
 
 typedef int (* generic_func)(char);
 typedef generic_func (* sm_func)(char);
 
+typedef struct {
+  char          delims[SM_MAX_LEVELS]; // Delimiter byte of each level, outermost first
+  unsigned int  levels;    // Number of delimiter levels
+  unsigned int  min_run;   // Delimiter bytes needed at the start of a line
+  char          same_line; // Whether text after the run is the label
+  unsigned char label_chars[256]; // Nonzero for bytes kept in label text
+} sm_grammar;
+
+typedef struct {
+  unsigned int  min_run;
+  unsigned int  levels;
+  char          delims[SM_MAX_LEVELS]; // Delimiter byte of each level
+  unsigned char next[SM_MAX_STATES][256]; // Next state by state and byte
+  unsigned char level[SM_MAX_STATES];     // Level of each delimiter state
+  unsigned char label_chars[256];
+} sm_table;
+
+typedef struct {
+  // Called when a label line begins. `fpos` is the offset of the label line,
+  // `delim_pos` the offset of the delimiter line preceeding it, and `level`
+  // the level of that delimiter (0 for the outermost).
+  void (* label_start)(void * ctx, long int fpos, long int delim_pos, unsigned int level);
+  // Called when a label line is complete, with the label text collected so far
+  // (up to SM_LABEL_MAX_SIZE characters, not null terminated).
+  void (* label_end)(void * ctx, long int fpos, const char * text, unsigned int length);
+  void * ctx;
+} sm_callbacks;
+
+typedef struct {
+  const sm_table * table;  // Compiled grammar being run
+  unsigned int  state;     // Current state in the table
+  long int      offset;    // Absolute offset of the next byte to be fed
+  long int      line_pos;  // Offset of the start of the current line
+  long int      label_pos; // Offset of the label line being read, or -1
+  unsigned int  label_len; // Number of label characters collected
+  sm_callbacks  cb;
+  char          label[SM_LABEL_MAX_SIZE];
+} sm_parser;
+
 
 int run_iteration(sm_func *, char, char *);
 sm_func entry(char);
@@ -25,8 +91,40 @@ sm_func
   equals4(char)
 ;
 
+void sm_grammar_default(sm_grammar *);
+int sm_grammar_set_class(sm_grammar *, const char *);
+int sm_table_build(sm_table *, const sm_grammar *);
+
+void sm_parser_init(sm_parser *, const sm_table *, const sm_callbacks *);
+int sm_parser_feed(sm_parser *, const char *, size_t);
+int sm_parser_finish(sm_parser *);
+long int sm_parser_delim_line(const sm_parser *);
+
 
 #ifndef INCLUDING_SM
+// Labels reported by the parser, kept the same way as the run_iteration test
+typedef struct {
+  unsigned int count;
+  char         texts[3][21];
+} test_labels;
+
+static void test_label_start(void * ctx, long int fpos, long int delim_pos, unsigned int level){
+  printf("  label at %ld (delimiter at %ld, level %u)", fpos, delim_pos, level);
+}
+
+static void test_label_end(void * ctx, long int fpos, const char * text, unsigned int length){
+  printf(": %.*s\n", (int)length, text);
+
+  test_labels * found = ctx;
+  if(found == NULL) return;
+  if(found->count < 3){
+    if(length > 20) length = 20;
+    memcpy(found->texts[found->count], text, length);
+    found->texts[found->count][length] = '\0';
+  }
+  ++found->count;
+}
+
 int main(int argl, char ** argv){
   char str[] = "abcdefg\n======abc==\nlabel a:\nhijklmnop\n=====\nANOTHER_LABEL:\nqq";
   printf("Running state machine on the following:\n%s\n\n", str);
@@ -63,6 +161,79 @@ int main(int argl, char ** argv){
 
   printf("Finished\n");
   printf("Found labels:\n  1: %s\n  2: %s\n  3: %s\n", lbuf1, lbuf2, lbuf3);
+
+  unsigned int expected = 0;
+  while(expected < 3 && lbufs[expected][0] != '\0') ++expected;
+
+  // Feed the same text through the parser in various chunk sizes; every run
+  // should report the same labels as the state machine above
+  test_labels found;
+  sm_callbacks cb = {
+    .label_start = test_label_start,
+    .label_end = test_label_end,
+    .ctx = &found,
+  };
+  sm_grammar g;
+  sm_table t;
+  size_t slen = sizeof(str) - 1;
+  int failed = 0;
+
+  sm_grammar_default(&g);
+  sm_table_build(&t, &g);
+
+  for(size_t chunk = 1; chunk <= slen; chunk += 6){
+    sm_parser p;
+    sm_parser_init(&p, &t, &cb);
+    found.count = 0;
+    printf("\nParser with %zu byte chunks:\n", chunk);
+    for(size_t pos = 0; pos < slen; pos += chunk)
+      sm_parser_feed(&p, str + pos, slen - pos < chunk ? slen - pos : chunk);
+    sm_parser_finish(&p);
+
+    if(found.count != expected){
+      printf("MISMATCH: parser found %u labels, state machine found %u\n", found.count, expected);
+      failed = 1;
+      continue;
+    }
+    for(unsigned int j = 0; j < expected; ++j){
+      if(strcmp(found.texts[j], lbufs[j]) != 0){
+        printf("MISMATCH: parser label %u is \"%s\", state machine has \"%s\"\n", j + 1, found.texts[j], lbufs[j]);
+        failed = 1;
+      }
+    }
+  }
+
+  cb.ctx = NULL;
+
+  // A different grammar: 3+ '-', labels may follow on the same line
+  char str2[] = "--\nnot a label\n--- same line\nbody\n----\nnext line\n---";
+  printf("\nRunning '---' grammar with same line labels on:\n%s\n", str2);
+
+  g.delims[0] = '-';
+  g.min_run = 3;
+  g.same_line = 1;
+  sm_table_build(&t, &g);
+
+  sm_parser p;
+  sm_parser_init(&p, &t, &cb);
+  sm_parser_feed(&p, str2, sizeof(str2) - 1);
+  sm_parser_finish(&p);
+
+  // Nested levels: '=' chapters with '-' subsections
+  char str3[] = "=====\nCH1\n-----\nSEC1\n-----\nSEC2\n=====\nCH2\n----\n";
+  printf("\nRunning nested '=' and '-' grammar on:\n%s\n", str3);
+
+  sm_grammar_default(&g);
+  g.delims[1] = '-';
+  g.levels = 2;
+  sm_table_build(&t, &g);
+
+  sm_parser_init(&p, &t, &cb);
+  sm_parser_feed(&p, str3, sizeof(str3) - 1);
+  sm_parser_finish(&p);
+
+  if(failed) printf("\nParser does not match the state machine\n");
+  return failed;
 }
 #endif
 
@@ -117,6 +288,218 @@ int run_iteration(sm_func * f, char c, char * lstore){
 }
 
 
+/* Fill in the grammar matching the state machine above: labels follow a line
+ * starting with 5 '=', and consist of spaces, '_', '-' and alphanumerics.
+ */
+void sm_grammar_default(sm_grammar * g){
+  g->delims[0] = '=';
+  g->levels = 1;
+  g->min_run = 5;
+  g->same_line = 0;
+  sm_grammar_set_class(g, "A-Za-z0-9 _-");
+}
+
+
+/* Set the label character class of the grammar from a list of characters and
+ * ranges, such as "A-Za-z0-9_". A '-' at either end is taken literally.
+ *
+ * Returns 0 on success, or 1 for an empty or backwards class.
+ */
+int sm_grammar_set_class(sm_grammar * g, const char * spec){
+  unsigned char chars[256] = {0};
+  size_t len = strlen(spec);
+
+  for(size_t j = 0; j < len; ++j){
+    unsigned char lo = (unsigned char)spec[j];
+    unsigned char hi = lo;
+
+    if(j + 2 < len && spec[j + 1] == '-'){
+      hi = (unsigned char)spec[j + 2];
+      if(hi < lo) return 1;
+      j += 2;
+    }
+
+    for(unsigned int c = lo; c <= hi; ++c) chars[c] = 1;
+  }
+
+  if(len == 0) return 1;
+
+  memcpy(g->label_chars, chars, sizeof(chars));
+  return 0;
+}
+
+
+/* Compile the given grammar into a table of state transitions, so that running
+ * it costs one lookup per byte whatever the grammar is.
+ *
+ * Returns 0 on success, or 1 if the grammar is not usable.
+ */
+int sm_table_build(sm_table * t, const sm_grammar * g){
+  if(g->min_run < 1 || g->min_run > SM_MAX_RUN) return 1;
+  if(g->levels < 1 || g->levels > SM_MAX_LEVELS) return 1;
+
+  for(unsigned int l = 0; l < g->levels; ++l){
+    if(g->delims[l] == '\n') return 1;
+    for(unsigned int m = 0; m < l; ++m)
+      if(g->delims[m] == g->delims[l]) return 1;
+  }
+
+  t->min_run = g->min_run;
+  t->levels = g->levels;
+  memcpy(t->delims, g->delims, sizeof(t->delims));
+  memcpy(t->label_chars, g->label_chars, sizeof(t->label_chars));
+  memset(t->level, 0, sizeof(t->level));
+
+  for(unsigned int c = 0; c < 256; ++c){
+    // Line start: begin a run of whichever level's delimiter this is
+    t->next[SM_LINE][c] = c == '\n' ? SM_LINE : SM_IGNORE(t);
+    for(unsigned int l = 0; l < t->levels; ++l)
+      if(c == (unsigned char)g->delims[l]) t->next[SM_LINE][c] = SM_RUN(t, l, 1);
+
+    for(unsigned int l = 0; l < t->levels; ++l){
+      unsigned char delim = (unsigned char)g->delims[l];
+      unsigned int matched = SM_DELIM(t, l);
+
+      // Partial runs: continue the run, or give up on the line
+      for(unsigned int n = 1; n < t->min_run; ++n){
+        unsigned int s = SM_RUN(t, l, n);
+        if(c == delim) t->next[s][c] = s + 1;
+        else if(c == '\n') t->next[s][c] = SM_LINE;
+        else t->next[s][c] = SM_IGNORE(t);
+      }
+
+      // Run matched: the label is on the next line, or on this one after any
+      // further delimiter bytes and blanks
+      if(c == '\n'){
+        t->next[matched][c] = SM_LABEL(t);
+      } else if(g->same_line
+      && c != delim && c != ' ' && c != '\t' && c != '\r'
+      ){
+        t->next[matched][c] = SM_LABEL(t);
+      } else {
+        t->next[matched][c] = matched;
+      }
+
+      t->level[matched] = l;
+    }
+
+    t->next[SM_IGNORE(t)][c] = c == '\n' ? SM_LINE : SM_IGNORE(t);
+    t->next[SM_LABEL(t)][c] = c == '\n' ? SM_LINE : SM_LABEL(t);
+  }
+
+  return 0;
+}
+
+
+/* Prepare a parser for a new stream of input, starting at offset 0, using the
+ * given compiled grammar. The callbacks are copied, and either of them may be
+ * NULL.
+ */
+void sm_parser_init(sm_parser * p, const sm_table * t, const sm_callbacks * cb){
+  p->table = t;
+  p->state = SM_LINE;
+  p->offset = 0;
+  p->line_pos = 0;
+  p->label_pos = -1;
+  p->label_len = 0;
+  p->cb = *cb;
+}
+
+
+/* Feed the next chunk of input to the parser. Chunks may be any size, and
+ * delimiters and labels may be split between them; all state needed to carry
+ * on is kept in the parser itself, so no memory is allocated here.
+ *
+ * Uninteresting lines, which are most of any file, are skipped with memchr
+ * rather than stepped through the table byte by byte.
+ *
+ * Returns 0 on success.
+ */
+int sm_parser_feed(sm_parser * p, const char * buf, size_t len){
+  const sm_table * t = p->table;
+  const unsigned char * start = (const unsigned char *)buf;
+  const unsigned char * end = start + len;
+  const unsigned char * b = start;
+  unsigned int state = p->state;
+  unsigned int ignore = SM_IGNORE(t);
+  unsigned int in_label = SM_LABEL(t);
+
+  while(b < end){
+    if(state == ignore){
+      const unsigned char * nl = memchr(b, '\n', (size_t)(end - b));
+      if(nl == NULL) break;
+      b = nl + 1;
+      state = SM_LINE;
+      continue;
+    }
+
+    long int pos = p->offset + (long int)(b - start);
+    unsigned char c = *b++;
+    unsigned int next = t->next[state][c];
+
+    // Note where lines start, so label_start can report the delimiter position
+    if(state == SM_LINE) p->line_pos = pos;
+
+    if(next == in_label){
+      if(state != in_label){
+        // Entering a label, either after the delimiter line's newline or at
+        // the first label byte on the delimiter line itself
+        p->label_pos = c == '\n' ? pos + 1 : pos;
+        p->label_len = 0;
+        if(p->cb.label_start != NULL)
+          p->cb.label_start(p->cb.ctx, p->label_pos, p->line_pos, t->level[state]);
+      }
+
+      if(c != '\n' && t->label_chars[c] && p->label_len < SM_LABEL_MAX_SIZE)
+        p->label[p->label_len++] = (char)c;
+    } else if(state == in_label){
+      // Label line finished
+      if(p->cb.label_end != NULL)
+        p->cb.label_end(p->cb.ctx, p->label_pos, p->label, p->label_len);
+      p->label_pos = -1;
+      p->label_len = 0;
+    }
+
+    state = next;
+  }
+
+  p->state = state;
+  p->offset += (long int)len;
+
+  return 0;
+}
+
+
+/* Signal the end of input. A label line which was still being read (such as
+ * one at the very end of the input with no trailing newline) is completed.
+ *
+ * Returns 0 on success.
+ */
+int sm_parser_finish(sm_parser * p){
+  if(p->label_pos >= 0 && p->cb.label_end != NULL)
+    p->cb.label_end(p->cb.ctx, p->label_pos, p->label, p->label_len);
+
+  p->state = SM_LINE;
+  p->label_pos = -1;
+  p->label_len = 0;
+
+  return 0;
+}
+
+
+/* Returns the offset where the line the parser is part way through began, if
+ * that line could still turn out to be a delimiter line, or -1 if it cannot.
+ * At the start of a line, that is the offset of the next byte to be fed.
+ */
+long int sm_parser_delim_line(const sm_parser * p){
+  const sm_table * t = p->table;
+
+  if(p->state == SM_LINE) return p->offset;
+  if(p->state == SM_IGNORE(t) || p->state == SM_LABEL(t)) return -1;
+  return p->line_pos;
+}
+
+
 /* Entry state
  * The beginning of a line
  * Looking for an equals sign, failure ignores the line
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Regression test for label filters combined with nested delimiter grammars:
+# a label dropped by the filters must still end the subtrees of the labels
+# open at its level or deeper.
+#
+# Run from the repository root: sh tests/nested_filters.sh
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+gcc -O2 -pthread -o "$dir/filer" filer.c || exit 1
+
+printf '=====\nCH_A\naaaa\n-----\nERR_A1\nxx\n=====\nCH_B\nbbbbbbbbbb\n-----\nERR_B1\nyy\n=====\nCH_C\ncc\n' > "$dir/t1.txt"
+
+failed=0
+
+check(){
+  if [ "$2" != "$3" ]; then
+    printf 'FAIL: %s\n  expected: %s\n  got:      %s\n' "$1" "$3" "$2"
+    failed=1
+  fi
+}
+
+for mode in "" "-l"; do
+  run(){
+    printf "$1" | "$dir/filer" $mode -d = -d - -f '^CH_A$|^ERR_B1$' "$dir/t1.txt" 2>/dev/null
+  }
+
+  # ERR_B1's parent CH_B was dropped, so it has no parent
+  got=$("$dir/filer" -d = -d - -f '^CH_A$|^ERR_B1$' -o tsv "$dir/t1.txt" 2>/dev/null | tr '\t\n' ',;')
+  check "parents" "$got" "index,fpos,level,parent,length,bytes,text;0,6,0,,4,10,CH_A;1,60,1,,6,10,ERR_B1;"
+
+  # CH_A's subtree ends at CH_B's delimiter
+  got=$(run '5\n0\n0\n' | grep -c 'bbbb')
+  check "subtree of CH_A$mode" "$got" "0"
+
+  got=$(run '6\n0\n0\n' | grep -A1 'Sections in CH_A' | tail -n 1)
+  check "children of CH_A$mode" "$got" ""
+
+  # Offset 55 is within CH_B, which was dropped
+  got=$(run '7\n55\n0\n' | grep -o 'Offset 55 [a-z ]*')
+  check "offset in dropped section$mode" "$got" "Offset 55 is not within any labeled section"
+done
+
+[ $failed -eq 0 ] && echo "All nested filter tests passed"
+exit $failed